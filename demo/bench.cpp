@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <map>
+#include <vector>
+#include "serial/serial.h"
+#include "ymodem.h"
+#include "multiport.h"
+
+#ifndef YM_DEMO_URING
+#define YM_DEMO_URING 0
+#endif
+
+#if YM_DEMO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Syscalls and CPU time per MB of the sender, the same transfer over the
+ * same ptys three ways: serial::Serial in blocking mode, a thread per port
+ * going through SerialImpl::read/write and their select calls, and the
+ * multi-port sender on epoll and on io_uring. The sender runs in a child
+ * process, the receivers in threads on the pty masters here.
+ *
+ * Each way runs twice. The syscalls are counted by tracing the child with
+ * ptrace, so every path is counted alike, setup included. Tracing slows the
+ * syscalls down, so the CPU time is taken from a second run untraced. The
+ * table goes to stderr, the engine logs to stdout.
+ *
+ *   ymodem_transport_bench [ports] [file KB] > /dev/null
+ */
+
+#define BENCH_TIMEOUT_MS  1000
+#define BENCH_RETRY       10
+
+#define PATH_SERIAL  0
+#define PATH_EPOLL   1
+#define PATH_URING   2
+
+typedef struct{
+	ymodem_t ym;               /* first, the callbacks get the peer from it */
+	int      fd;               /* pty master */
+	int      result;           /* of the receive session */
+	char     tty[64];          /* pty slave the sender opens */
+	char     filename[256];
+	ym_mem_sink_t sink;
+	uint8_t *buffer;
+}bench_rx_t;
+
+typedef struct{
+	ymodem_t ym;               /* first, the callbacks get the sender from it */
+	serial::Serial *serial;
+	const char *tty;
+	int      result;
+}bench_tx_t;
+
+static uint8_t *image;
+static int image_size;
+static char image_name[] = "/tmp/ymodem_benchXXXXXX";
+
+/* Receiver: plain reads and writes on the pty master ------------------------*/
+static int rxGetBlock( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	bench_rx_t *rx = (bench_rx_t *)ym;
+	struct pollfd fds = { rx->fd, POLLIN, 0 };
+	int count = 0;
+	int ret;
+
+	while( count < size ){
+		ret = poll( &fds, 1, count > 0 ? 0 : timeout );
+		if( ret <= 0 ){
+			break;
+		}
+		ret = read( rx->fd, data + count, size - count );
+		if( ret <= 0 ){
+			break;
+		}
+		count += ret;
+	}
+	return count;
+}
+
+static int rxGetByte( ymodem_t *ym, int timeout ){
+	uint8_t bdata;
+
+	return rxGetBlock( ym, &bdata, 1, timeout ) == 1 ? bdata : -1;
+}
+
+static int rxPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	bench_rx_t *rx = (bench_rx_t *)ym;
+	int count = 0;
+	int ret;
+
+	while( count < size ){
+		ret = write( rx->fd, data + count, size - count );
+		if( ret < 0 && errno == EINTR ){
+			continue;
+		}
+		if( ret <= 0 ){
+			return -1;
+		}
+		count += ret;
+	}
+	return size;
+}
+
+static int rxPutByte( ymodem_t *ym, uint8_t bdata ){
+	return rxPutBlock( ym, &bdata, 1 ) == 1 ? 0 : -1;
+}
+
+static void *receiver( void *arg ){
+	bench_rx_t *rx = (bench_rx_t *)arg;
+
+	rx->ym.config.getByte = rxGetByte;
+	rx->ym.config.getBlock = rxGetBlock;
+	rx->ym.config.putByte = rxPutByte;
+	rx->ym.config.putBlock = rxPutBlock;
+	rx->ym.config.sink = ymodem_memSink( &rx->sink, rx->buffer, image_size + YM_PACKET_SIZE_1K );
+	rx->ym.config.timeout = BENCH_TIMEOUT_MS;
+	rx->ym.config.num_of_retry = BENCH_RETRY;
+	ymodem_init( &rx->ym );
+	ymodem_startReceive( &rx->ym, rx->filename, sizeof(rx->filename) );
+	rx->result = ymodem_runReceive( &rx->ym );
+	return NULL;
+}
+
+/* A pty pair in raw mode, the slave stays open here so nothing the
+ * receiver sends before the sender opens it is echoed or lost to a hangup */
+static int ptyOpen( bench_rx_t *rx, int *slave ){
+	struct termios tio;
+
+	rx->fd = posix_openpt( O_RDWR | O_NOCTTY | O_CLOEXEC );
+	if( rx->fd < 0 || grantpt( rx->fd ) < 0 || unlockpt( rx->fd ) < 0 ||
+			ptsname_r( rx->fd, rx->tty, sizeof(rx->tty) ) != 0 ){
+		return -1;
+	}
+	*slave = open( rx->tty, O_RDWR | O_NOCTTY | O_CLOEXEC );
+	if( *slave < 0 || tcgetattr( *slave, &tio ) < 0 ){
+		return -1;
+	}
+	cfmakeraw( &tio );
+	return tcsetattr( *slave, TCSANOW, &tio );
+}
+
+/* Sender on the select path: ymodemSend of the demo, a thread per port ------*/
+static int txPutByte( ymodem_t *ym, uint8_t bdata ){
+	((bench_tx_t *)ym)->serial->write( &bdata, 1 );
+	return 1;
+}
+
+static int txPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	return ((bench_tx_t *)ym)->serial->write( data, size );
+}
+
+static void txFlush( ymodem_t *ym ){
+	((bench_tx_t *)ym)->serial->flushWrites();
+}
+
+static int txGetByte( ymodem_t *ym, int timeout ){
+	serial::Serial *serialport = ((bench_tx_t *)ym)->serial;
+	uint8_t bdata;
+
+	if( timeout == 0 && serialport->available() == 0 ){
+		return -1;
+	}
+	return serialport->read( &bdata, 1 ) == 1 ? bdata : -1;
+}
+
+static int txGetBlock( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	serial::Serial *serialport = ((bench_tx_t *)ym)->serial;
+
+	if( timeout == 0 ){
+		/* Poll, take only what is there */
+		size_t count = serialport->available();
+		if( count < (size_t)size ){
+			size = count;
+		}
+		if( size == 0 ){
+			return 0;
+		}
+	}
+	return serialport->read( data, size );
+}
+
+static void *sender( void *arg ){
+	bench_tx_t *tx = (bench_tx_t *)arg;
+	serial::Serial serialport;
+	serial::Timeout timeout = serial::Timeout::simpleTimeout( BENCH_TIMEOUT_MS );
+	int ret;
+	int off;
+
+	tx->result = YM_ERROR_COMM;
+	serialport.setPort( std::string(tx->tty) );
+	serialport.setTimeout( timeout );
+	try{
+		serialport.open();
+	}
+	catch( const serial::IOException &e ){
+		printf( "%s: can't open serial port, %s.\n", tx->tty, e.what() );
+		return NULL;
+	}
+	serialport.setWriteCoalescing( true );
+	tx->serial = &serialport;
+
+	tx->ym.config.putByte = txPutByte;
+	tx->ym.config.putBlock = txPutBlock;
+	tx->ym.config.getByte = txGetByte;
+	tx->ym.config.getBlock = txGetBlock;
+	tx->ym.config.flush = txFlush;
+	tx->ym.config.timeout = 5;
+	tx->ym.config.num_of_retry = 5;
+	tx->ym.config.options = YM_OPT_PIPELINE;
+	ymodem_init( &tx->ym );
+	ret = ymodem_startTransmit( &tx->ym, image_name, BENCH_RETRY );
+	for( off=0; ret == YM_SUCCESS && off < image_size; off += 1024 ){
+		ret = ymodem_transmit( &tx->ym, image + off, image_size - off < 1024 ? image_size - off : 1024 );
+	}
+	if( ret == YM_SUCCESS ){
+		/* It doesn't report success, the receiver does */
+		ymodem_finishTransmit( &tx->ym );
+	}
+	tx->result = ret;
+	serialport.close();
+	return NULL;
+}
+
+static int serialSend( std::vector<bench_rx_t> &rxs ){
+	std::vector<bench_tx_t> txs( rxs.size() );
+	std::vector<pthread_t> threads( rxs.size() );
+	int failed = 0;
+
+	for( size_t idx=0; idx<rxs.size(); ++idx ){
+		memset( &txs[idx], 0, sizeof(txs[idx]) );
+		txs[idx].tty = rxs[idx].tty;
+		pthread_create( &threads[idx], NULL, sender, &txs[idx] );
+	}
+	for( size_t idx=0; idx<rxs.size(); ++idx ){
+		pthread_join( threads[idx], NULL );
+		failed += txs[idx].result != YM_SUCCESS;
+	}
+	return failed;
+}
+
+/* The sender process ---------------------------------------------------------*/
+static void child( int path, int traced, std::vector<bench_rx_t> &rxs ){
+	std::vector<char *> ttys;
+	int fd;
+	int ret;
+
+	if( traced ){
+		if( ptrace( PTRACE_TRACEME, 0, NULL, NULL ) < 0 ){
+			_exit( 2 );
+		}
+		raise( SIGSTOP );
+	}
+	fd = open( "/dev/null", O_WRONLY );
+	if( fd >= 0 ){
+		dup2( fd, STDOUT_FILENO );
+		close( fd );
+	}
+
+	if( path == PATH_SERIAL ){
+		ret = serialSend( rxs );
+	}
+	else{
+		for( size_t idx=0; idx<rxs.size(); ++idx ){
+			ttys.push_back( rxs[idx].tty );
+		}
+		ret = multiportSend( image_name, &ttys[0], (int)ttys.size(), path == PATH_URING );
+	}
+	fflush( stdout );
+	_exit( ret == 0 ? 0 : 1 );
+}
+
+/* Syscalls the child and its threads enter until it exits */
+static long traceChild( pid_t pid, int *status ){
+	std::map<pid_t, int> in_call;
+	long calls = 0;
+	pid_t tid;
+
+	if( waitpid( pid, status, 0 ) != pid || !WIFSTOPPED( *status ) ){
+		return -1;
+	}
+	ptrace( PTRACE_SETOPTIONS, pid, NULL,
+			(void *)(long)( PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL ) );
+	ptrace( PTRACE_SYSCALL, pid, NULL, NULL );
+
+	while( ( tid = waitpid( -1, status, __WALL ) ) > 0 ){
+		long sig = 0;
+
+		if( WIFEXITED( *status ) || WIFSIGNALED( *status ) ){
+			if( tid == pid ){
+				break;
+			}
+			continue;
+		}
+		if( WSTOPSIG( *status ) == ( SIGTRAP | 0x80 ) ){
+			calls += !in_call[tid];
+			in_call[tid] = !in_call[tid];
+		}
+		else if( ( *status >> 16 ) == 0 && WSTOPSIG( *status ) != SIGSTOP ){
+			/* Not a clone event or the stop of a new thread */
+			sig = WSTOPSIG( *status );
+		}
+		ptrace( PTRACE_SYSCALL, tid, NULL, (void *)sig );
+	}
+	return calls;
+}
+
+/*
+ * Send the image to every port once
+ * @ret Ports whose file arrived intact, calls and cpu (us) of the sender
+ */
+static int run( int path, int ports, int traced, long *calls, long *cpu ){
+	std::vector<bench_rx_t> rxs( ports );
+	std::vector<pthread_t> threads( ports );
+	std::vector<int> slaves( ports, -1 );
+	struct rusage ru;
+	int status = 0;
+	int done = 0;
+	pid_t pid;
+
+	for( int idx=0; idx<ports; ++idx ){
+		memset( &rxs[idx], 0, sizeof(rxs[idx]) );
+		rxs[idx].fd = -1;
+		rxs[idx].buffer = (uint8_t *)malloc( image_size + YM_PACKET_SIZE_1K );
+		if( rxs[idx].buffer == NULL || ptyOpen( &rxs[idx], &slaves[idx] ) < 0 ){
+			perror( "pty" );
+			exit( 1 );
+		}
+	}
+
+	/* Fork before the receiver threads start, the child still mallocs */
+	fflush( stdout );
+	pid = fork();
+	if( pid < 0 ){
+		perror( "fork" );
+		exit( 1 );
+	}
+	if( pid == 0 ){
+		child( path, traced, rxs );
+	}
+
+	for( int idx=0; idx<ports; ++idx ){
+		pthread_create( &threads[idx], NULL, receiver, &rxs[idx] );
+	}
+	*calls = 0;
+	*cpu = 0;
+	if( traced ){
+		*calls = traceChild( pid, &status );
+		if( *calls < 0 ){
+			fprintf( stderr, "Can't trace the sender.\n" );
+		}
+	}
+	else if( wait4( pid, &status, 0, &ru ) == pid ){
+		*cpu = (long)( ru.ru_utime.tv_sec + ru.ru_stime.tv_sec ) * 1000000 +
+				ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	}
+
+	for( int idx=0; idx<ports; ++idx ){
+		pthread_join( threads[idx], NULL );
+		if( rxs[idx].result == YM_DONE && rxs[idx].sink.size == (uint32_t)image_size &&
+				memcmp( rxs[idx].buffer, image, image_size ) == 0 ){
+			done ++;
+		}
+		close( rxs[idx].fd );
+		close( slaves[idx] );
+		free( rxs[idx].buffer );
+	}
+	return done;
+}
+
+#if YM_DEMO_URING
+/* The multi-port sender falls back to epoll without it */
+static int uringAvailable( void ){
+	struct io_uring_params params;
+	int fd;
+
+	memset( &params, 0, sizeof(params) );
+	fd = (int)syscall( __NR_io_uring_setup, 4, &params );
+	if( fd < 0 ){
+		return 0;
+	}
+	close( fd );
+	return ( params.features & IORING_FEAT_RW_CUR_POS ) != 0;
+}
+#endif
+
+int main( int argc, char *argv[] ){
+	static const char *names[] = { "serial select", "epoll", "io_uring" };
+	int paths = YM_DEMO_URING ? 3 : 2;
+	int ports;
+	int fd;
+
+	ports = argc > 1 ? atoi( argv[1] ) : 8;
+	image_size = ( argc > 2 ? atoi( argv[2] ) : 2048 ) * 1024;
+	if( ports <= 0 || image_size <= 0 ){
+		printf( "Usage: %s [ports] [file KB]\n", argv[0] );
+		return 1;
+	}
+
+	/* The multi-port sender maps the image from a file */
+	image = (uint8_t *)malloc( image_size );
+	fd = mkstemp( image_name );
+	if( image == NULL || fd < 0 ){
+		perror( "image" );
+		return 1;
+	}
+	for( int idx=0; idx<image_size; ++idx ){
+		image[idx] = rand();
+	}
+	if( write( fd, image, image_size ) != image_size ){
+		perror( "image" );
+		unlink( image_name );
+		return 1;
+	}
+	close( fd );
+
+	double mb = (double)ports * image_size / 1048576.0;
+	fprintf( stderr, "%d ports, %d KB each\n", ports, image_size / 1024 );
+	fprintf( stderr, "sender          syscalls/MB  CPU ms/MB  ports done\n" );
+	for( int path=0; path<paths; ++path ){
+		long calls;
+		long cpu;
+		long unused;
+		int done;
+
+#if YM_DEMO_URING
+		if( path == PATH_URING && !uringAvailable() ){
+			fprintf( stderr, "%-14s  not available\n", names[path] );
+			continue;
+		}
+#endif
+		done = run( path, ports, 0, &unused, &cpu );
+		done += run( path, ports, 1, &calls, &unused );
+		fprintf( stderr, "%-14s  %11.0f  %9.2f  %d of %d\n", names[path],
+				calls < 0 ? -1.0 : calls / mb, cpu / 1000.0 / mb, done, 2 * ports );
+	}
+
+	unlink( image_name );
+	free( image );
+	return 0;
+}
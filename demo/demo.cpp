@@ -5,11 +5,17 @@
 #include <unistd.h>
 #include "serial/serial.h"
 #include "ymodem.h"
+#ifdef __linux__
+#include "multiport.h"
+#endif
 
 void printUsage( const char *name ){
 	printf( "Usage:\n" );
 	printf( "\t%s --send [tty] [filename]\n", name );
 	printf( "\t%s --recv [tty] [filename]\n", name );
+#ifdef __linux__
+	printf( "\t%s --send-multi [--uring] [filename] [tty]...\n", name );
+#endif
 	printf( "\t%s --list-ports\n", name );
 	printf( "\n" );
 }
@@ -17,6 +23,7 @@ void printUsage( const char *name ){
 #define CMD_SEND       1
 #define CMD_RECV       2
 #define CMD_LIST_PORTS 3
+#define CMD_SEND_MULTI 4
 
 static void listPorts( void );
 static void ymodemSend( const char *tty, const char *filename );
@@ -33,13 +40,33 @@ static int putByte( ymodem_t *ym, uint8_t bdata ){
 	return 1;
 }
 
+static int putBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	(void)ym;
+	if( pserial == NULL ){
+		printf( "WHY?\n" );
+		return -1;
+	}
+	return pserial->write( data, size );
+}
+
+static void flush( ymodem_t *ym ){
+	(void)ym;
+	if( pserial == NULL ){
+		printf( "WHY?\n" );
+		return;
+	}
+	pserial->flushWrites();
+}
+
 static int getByte( ymodem_t *ym, int timeout ){
 	(void)ym;
-	(void)timeout;
 	if( pserial == NULL ){
 		printf( "WHY?\n" );
 		return -1;
 	}
+	if( timeout == 0 && pserial->available() == 0 ){
+		return -1;
+	}
 	uint8_t bdata;
 	int cnt = pserial->read( &bdata, 1 );
 	if( cnt != 1 ){
@@ -48,6 +75,24 @@ static int getByte( ymodem_t *ym, int timeout ){
 	return bdata;
 }
 
+static int getBlock( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	(void)ym;
+	if( pserial == NULL ){
+		printf( "WHY?\n" );
+		return -1;
+	}
+	if( timeout == 0 ){
+		/* Poll, take only what is there */
+		size_t count = pserial->available();
+		if( count < (size_t)size ){
+			size = count;
+		}
+		if( size == 0 ){
+			return 0;
+		}
+	}
+	return pserial->read( data, size );
+}
 
 int main( int argc, char *argv[] ){
 	int cmd = 0;
@@ -78,6 +123,15 @@ int main( int argc, char *argv[] ){
 		}
 		cmd = CMD_LIST_PORTS;
 	}
+#ifdef __linux__
+	else if( strcmp( argv[1], "--send-multi" ) == 0 ){
+		if( argc < 4 ){
+			printUsage( argv[0] );
+			return -1;
+		}
+		cmd = CMD_SEND_MULTI;
+	}
+#endif
 
 	if( cmd == CMD_SEND ){
 		ymodemSend( argv[2], argv[3] );
@@ -88,6 +142,16 @@ int main( int argc, char *argv[] ){
 	else if( cmd == CMD_LIST_PORTS ){
 		listPorts();
 	}
+#ifdef __linux__
+	else if( cmd == CMD_SEND_MULTI ){
+		int uring = strcmp( argv[2], "--uring" ) == 0;
+		if( argc < 4 + uring ){
+			printUsage( argv[0] );
+			return -1;
+		}
+		return multiportSend( argv[2+uring], &argv[3+uring], argc - 3 - uring, uring ) == 0 ? 0 : -1;
+	}
+#endif
 	else{
 		printUsage( argv[0] );
 	}
@@ -137,6 +201,8 @@ void ymodemSend( const char *tty, const char *filename ){
 		return;
 	}
 	pserial = &serialport;
+	/* A packet or an answer goes out in one write at the flush points */
+	serialport.setWriteCoalescing( true );
 	serialport.flush();
 
 	std::ifstream ifs( filename, std::ios::binary );
@@ -144,11 +210,17 @@ void ymodemSend( const char *tty, const char *filename ){
 		printf( "Can't open input file.\n" );
 		return;
 	}
+
 	ymodem_t ym;
+	memset( &ym, 0, sizeof(ym) );
 	ym.config.num_of_retry = 5;
 	ym.config.putByte = putByte;
+	ym.config.putBlock = putBlock;
 	ym.config.getByte = getByte;
+	ym.config.getBlock = getBlock;
+	ym.config.flush = flush;
 	ym.config.timeout = 5;
+	ym.config.options = YM_OPT_PIPELINE;
 	ymodem_init( &ym );
 	int ret;
 	ret = ymodem_startTransmit( &ym, filename, 10 );
@@ -187,6 +259,8 @@ void ymodemRecv( const char *tty, const char *filename ){
 	serialport.setBytesize( serial::eightbits );
 	serialport.setStopbits( serial::stopbits_one );
 	serialport.setPort( std::string(tty) );
+	serial::Timeout timeout = serial::Timeout::simpleTimeout( 1000 );
+	serialport.setTimeout( timeout );
 	try{
 		serialport.open();
 	}
@@ -198,5 +272,38 @@ void ymodemRecv( const char *tty, const char *filename ){
 		printf( "Can't open serial port.\n" );
 		return;
 	}
+	pserial = &serialport;
+	/* A packet or an answer goes out in one write at the flush points */
+	serialport.setWriteCoalescing( true );
+
+	ym_mmap_sink_t sink;
+	static ym_async_sink_t async;
+	ym_sink_t *writer = ymodem_asyncSink( &async, ymodem_mmapSink( &sink, filename ) );
+	if( writer == NULL ){
+		printf( "Can't start the writer thread.\n" );
+		return;
+	}
+	ymodem_t ym;
+	memset( &ym, 0, sizeof(ym) );
+	ym.config.num_of_retry = 5;
+	ym.config.putByte = putByte;
+	ym.config.putBlock = putBlock;
+	ym.config.getByte = getByte;
+	ym.config.getBlock = getBlock;
+	ym.config.flush = flush;
+	ym.config.sink = writer;
+	ym.config.timeout = 5;
+	ymodem_init( &ym );
+
+	char name[256];
+	int ret = ymodem_startReceive( &ym, name, sizeof(name) );
+	if( ret == YM_SUCCESS ){
+		ret = ymodem_runReceive( &ym );
+	}
+	printf( "Receive %s: %s\n", ret == YM_DONE ? "done" : "failed", name );
+	ymodem_asyncSinkStop( &async );
+
+	serialport.close();
+	pserial = NULL;
 }
 
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "ymodem.h"
+
+/*
+ * Goodput of stop-and-wait against the sliding window, one process: the
+ * sender and the receiver run in their own threads and talk through two
+ * socketpairs, a relay thread between them delays every chunk by the one
+ * way latency, paces it to the line rate and flips bits in both directions
+ * at the bit error rate. The table goes to stderr, the engine logs to
+ * stdout.
+ *
+ *   ymodem_goodput [file KB] [line rate B/s] > /dev/null
+ */
+
+#define GP_TIMEOUT_MS   200    /* plus the round trip */
+#define GP_RETRY        10
+#define GP_CHUNK        2048   /* largest read the relay forwards at once */
+#define GP_QUEUE        64     /* chunks on the way in each direction */
+
+typedef struct{
+	int64_t due;               /* when it arrives, us */
+	int     size;
+	uint8_t data[ GP_CHUNK ];
+}gp_chunk_t;
+
+/* One direction of the line */
+typedef struct{
+	int        in;             /* relay end towards the writer */
+	int        out;            /* relay end towards the reader */
+	int64_t    free;           /* when the line is done sending what it has, us */
+	int        head;
+	int        count;
+	unsigned   seed;           /* of the bit errors */
+	gp_chunk_t queue[ GP_QUEUE ];
+}gp_line_t;
+
+typedef struct{
+	ymodem_t ym;               /* first, the callbacks get the peer from it */
+	int      fd;
+	int      result;           /* of the receive session */
+}gp_peer_t;
+
+static int64_t latency_us;
+static int64_t rate;           /* bytes per second */
+static int     ber_ppm;        /* bit errors per million bits */
+static int     relay_stop;
+
+static int64_t nowUs( void ){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int writeAll( int fd, const uint8_t *data, int size ){
+	int count = 0;
+	int ret;
+
+	while( count < size ){
+		ret = write( fd, data + count, size - count );
+		if( ret < 0 && errno == EINTR ){
+			continue;
+		}
+		if( ret <= 0 ){
+			return -1;
+		}
+		count += ret;
+	}
+	return size;
+}
+
+/* Take what the writer sent, it arrives after the pacing and the latency */
+static void lineRead( gp_line_t *line ){
+	gp_chunk_t *chunk = &line->queue[ ( line->head + line->count ) % GP_QUEUE ];
+	int64_t now = nowUs();
+	int idx;
+
+	chunk->size = read( line->in, chunk->data, GP_CHUNK );
+	if( chunk->size <= 0 ){
+		return;
+	}
+	/* A byte is hit with the chance of one of its eight bits, close
+	 * enough at these rates */
+	for( idx=0; ber_ppm > 0 && idx<chunk->size; ++idx ){
+		if( rand_r( &line->seed ) % 1000000 < 8 * ber_ppm ){
+			chunk->data[idx] ^= 1 << ( rand_r( &line->seed ) % 8 );
+		}
+	}
+	if( line->free < now ){
+		line->free = now;
+	}
+	line->free += chunk->size * 1000000LL / rate;
+	chunk->due = line->free + latency_us;
+	line->count ++;
+}
+
+/* Hand over what arrived, return the time until the next chunk is due */
+static int lineWrite( gp_line_t *line ){
+	gp_chunk_t *chunk;
+	int64_t now = nowUs();
+
+	while( line->count > 0 ){
+		chunk = &line->queue[ line->head ];
+		if( chunk->due > now ){
+			return (int)( ( chunk->due - now + 999 ) / 1000 );
+		}
+		writeAll( line->out, chunk->data, chunk->size );
+		line->head = ( line->head + 1 ) % GP_QUEUE;
+		line->count --;
+	}
+	return -1;
+}
+
+static void *relay( void *arg ){
+	gp_line_t *lines = (gp_line_t *)arg;
+	struct pollfd fds[2];
+	int timeout;
+	int wait;
+	int idx;
+
+	while( !relay_stop ){
+		timeout = 10;
+		for( idx=0; idx<2; ++idx ){
+			wait = lineWrite( &lines[idx] );
+			if( wait >= 0 && wait < timeout ){
+				timeout = wait;
+			}
+			fds[idx].fd = lines[idx].in;
+			fds[idx].events = lines[idx].count < GP_QUEUE ? POLLIN : 0;
+		}
+		if( poll( fds, 2, timeout ) <= 0 ){
+			continue;
+		}
+		for( idx=0; idx<2; ++idx ){
+			if( fds[idx].revents & POLLIN ){
+				lineRead( &lines[idx] );
+			}
+		}
+	}
+	return NULL;
+}
+
+static int getBlock( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	gp_peer_t *peer = (gp_peer_t *)ym;
+	struct pollfd fds = { peer->fd, POLLIN, 0 };
+	int64_t end = nowUs() + (int64_t)timeout * 1000;
+	int count = 0;
+	int ret;
+
+	while( count < size ){
+		ret = poll( &fds, 1, (int)( ( end - nowUs() + 999 ) / 1000 ) );
+		if( ret <= 0 ){
+			break;
+		}
+		ret = read( peer->fd, data + count, size - count );
+		if( ret <= 0 ){
+			break;
+		}
+		count += ret;
+	}
+	return count;
+}
+
+static int getByte( ymodem_t *ym, int timeout ){
+	uint8_t bdata;
+
+	return getBlock( ym, &bdata, 1, timeout ) == 1 ? bdata : -1;
+}
+
+static int putBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	return writeAll( ((gp_peer_t *)ym)->fd, data, size );
+}
+
+static int putByte( ymodem_t *ym, uint8_t bdata ){
+	return putBlock( ym, &bdata, 1 ) == 1 ? 0 : -1;
+}
+
+static void peerInit( gp_peer_t *peer, int fd, int options ){
+	memset( peer, 0, sizeof(*peer) );
+	peer->fd = fd;
+	peer->ym.config.getByte = getByte;
+	peer->ym.config.getBlock = getBlock;
+	peer->ym.config.putByte = putByte;
+	peer->ym.config.putBlock = putBlock;
+	peer->ym.config.timeout = GP_TIMEOUT_MS + (int)( 2 * latency_us / 1000 );
+	peer->ym.config.num_of_retry = GP_RETRY;
+	peer->ym.config.options = options;
+	ymodem_init( &peer->ym );
+}
+
+static void *receiver( void *arg ){
+	gp_peer_t *peer = (gp_peer_t *)arg;
+	char filename[64];
+
+	ymodem_startReceive( &peer->ym, filename, sizeof(filename) );
+	peer->result = ymodem_runReceive( &peer->ym );
+	return NULL;
+}
+
+/* Send the image once, return the goodput in bytes per second, <0: failed */
+static double run( const uint8_t *image, int size, int options ){
+	gp_line_t *lines;
+	gp_peer_t tx;
+	gp_peer_t rx;
+	pthread_t threads[2];
+	int tx_fds[2];
+	int rx_fds[2];
+	int64_t start;
+	int64_t end;
+	int ret;
+	int off;
+
+	lines = (gp_line_t *)calloc( 2, sizeof(gp_line_t) );
+	if( lines == NULL ||
+			socketpair( AF_UNIX, SOCK_STREAM, 0, tx_fds ) < 0 ||
+			socketpair( AF_UNIX, SOCK_STREAM, 0, rx_fds ) < 0 ){
+		perror( "socketpair" );
+		exit( 1 );
+	}
+	/* Sender to receiver and back */
+	lines[0].in = tx_fds[1];
+	lines[0].out = rx_fds[1];
+	lines[1].in = rx_fds[1];
+	lines[1].out = tx_fds[1];
+	lines[0].seed = 1;
+	lines[1].seed = 2;
+
+	peerInit( &tx, tx_fds[0], options );
+	peerInit( &rx, rx_fds[0], options );
+	relay_stop = 0;
+	pthread_create( &threads[0], NULL, relay, lines );
+	pthread_create( &threads[1], NULL, receiver, &rx );
+
+	start = nowUs();
+	ret = ymodem_startTransmit( &tx.ym, "image.bin", GP_RETRY );
+	for( off=0; ret == YM_SUCCESS && off < size; off += 4096 ){
+		ret = ymodem_transmit( &tx.ym, image + off, size - off < 4096 ? size - off : 4096 );
+	}
+	if( ret == YM_SUCCESS ){
+		/* It doesn't report success, the receiver does */
+		ymodem_finishTransmit( &tx.ym );
+	}
+	end = nowUs();
+
+	pthread_join( threads[1], NULL );
+	relay_stop = 1;
+	pthread_join( threads[0], NULL );
+	close( tx_fds[0] );
+	close( tx_fds[1] );
+	close( rx_fds[0] );
+	close( rx_fds[1] );
+	free( lines );
+
+	return ret == YM_SUCCESS && rx.result == YM_DONE ? size * 1000000.0 / ( end - start ) : -1;
+}
+
+/* Goodput, or failed when the retries ran out */
+static void printRate( double goodput ){
+	if( goodput < 0 ){
+		fprintf( stderr, " %13s", "failed" );
+	}
+	else{
+		fprintf( stderr, " %9.0f B/s", goodput );
+	}
+}
+
+int main( int argc, char *argv[] ){
+	static const int latencies[] = { 0, 5, 20, 50 };
+	static const int bers[] = { 0, 1, 10, 30 };
+	uint8_t *image;
+	int size;
+	int lat;
+	int idx;
+
+	size = ( argc > 1 ? atoi( argv[1] ) : 64 ) * 1024;
+	rate = argc > 2 ? atoll( argv[2] ) : 100000;
+	if( size <= 0 || rate <= 0 ){
+		printf( "Usage: %s [file KB] [line rate B/s]\n", argv[0] );
+		return 1;
+	}
+
+	image = (uint8_t *)malloc( size );
+	if( image == NULL ){
+		return 1;
+	}
+	for( idx=0; idx<size; ++idx ){
+		image[idx] = rand();
+	}
+
+	fprintf( stderr, "%d KB at %lld B/s, window %d\n", size / 1024, (long long)rate, YM_WINDOW_MAX );
+	fprintf( stderr, "latency  BER ppm  stop-and-wait      windowed\n" );
+	for( lat=0; lat<(int)(sizeof(latencies)/sizeof(latencies[0])); ++lat ){
+		for( idx=0; idx<(int)(sizeof(bers)/sizeof(bers[0])); ++idx ){
+			latency_us = latencies[lat] * 1000LL;
+			ber_ppm = bers[idx];
+			fprintf( stderr, "%5dms %8d", latencies[lat], bers[idx] );
+			printRate( run( image, size, 0 ) );
+			printRate( run( image, size, YM_OPT_WINDOW ) );
+			fprintf( stderr, "\n" );
+		}
+	}
+
+	free( image );
+	return 0;
+}
@@ -0,0 +1,844 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <vector>
+#include "serial/serial.h"
+#include "ymodem.h"
+#include "multiport.h"
+
+#ifndef YM_DEMO_URING
+#define YM_DEMO_URING 0
+#endif
+
+#if YM_DEMO_URING
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Every port gets a non-blocking transmit session (ymodem_pollTransmit) and
+ * one thread drives all of them through a transport: epoll waiting on the
+ * port file descriptors, or io_uring with YM_DEMO_URING. serial::Serial opens
+ * the ports, a slow device never holds up the others. The image is mapped
+ * once and shared by all sessions.
+ */
+
+#define PORT_TIMEOUT_MS  1000  /* no answer for this long runs ymodem_onTimer */
+#define PORT_HEADER_TRY  10    /* header requests to wait for */
+#define PORT_EVENTS      64
+#define PORT_BUFFER_SIZE 4096  /* io_uring read and write buffers */
+
+typedef struct{
+	ymodem_t ym;              /* first, the callbacks get the port from it */
+	serial::Serial *serial;
+	const char *tty;
+	int      fd;
+	uint32_t events;          /* registered with epoll, 0: not registered */
+	size_t   offset;          /* image bytes read by the session */
+	int64_t  deadline;        /* ms, ymodem_onTimer is due */
+	int64_t  finished;        /* ms */
+	int      result;          /* YM_SUCCESS while running, YM_DONE or the error */
+#if YM_DEMO_URING
+	int      reading;         /* read and its linked timeout submitted */
+	int      cancel;          /* that read is being cancelled */
+	int      writing;         /* bytes of out submitted, 0: no write */
+	int      in_pos;
+	int      in_len;
+	int      out_len;
+	struct __kernel_timespec ts; /* of the linked timeout */
+	uint8_t  in[ PORT_BUFFER_SIZE ];
+	uint8_t  out[ PORT_BUFFER_SIZE ];
+#endif
+}port_t;
+
+/* How the sessions reach their ports */
+typedef struct{
+	const char *name;
+	int  (*putByte)( ymodem_t *ym, uint8_t bdata );
+	int  (*putBlock)( ymodem_t *ym, const uint8_t *data, int size );
+	int  (*getByte)( ymodem_t *ym, int timeout );
+	int  (*getBlock)( ymodem_t *ym, uint8_t *data, int size, int timeout );
+	int  (*init)( int count );   /* -1: not available here */
+	void (*run)( std::vector<port_t> &ports );
+	void (*fini)( void );
+}transport_t;
+
+static const uint8_t *image;
+static size_t image_size;
+static uint64_t syscalls;      /* made by the transport */
+
+static int64_t nowMs( void ){
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t cpuUs( void ){
+	struct rusage ru;
+	getrusage( RUSAGE_SELF, &ru );
+	return (int64_t)( ru.ru_utime.tv_sec + ru.ru_stime.tv_sec ) * 1000000 +
+			ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static port_t *portOf( ymodem_t *ym ){
+	return (port_t*)ym;
+}
+
+static int readData( ymodem_t *ym, uint8_t *data, int size ){
+	port_t *port = portOf( ym );
+	size_t count = image_size - port->offset;
+	if( count > (size_t)size ){
+		count = size;
+	}
+	memcpy( data, image + port->offset, count );
+	port->offset += count;
+	return (int)count;
+}
+
+static int portOpen( port_t *port ){
+	serial::Serial *serialport = new serial::Serial();
+	serialport->setBaudrate( 115200 );
+	serialport->setFlowcontrol( serial::flowcontrol_none );
+	serialport->setBytesize( serial::eightbits );
+	serialport->setStopbits( serial::stopbits_one );
+	serialport->setPort( std::string(port->tty) );
+	try{
+		serialport->open();
+	}
+	catch( const serial::IOException &e ){
+		printf( "%s: can't open serial port, %s.\n", port->tty, e.what() );
+		delete serialport;
+		return -1;
+	}
+	if( !serialport->isOpen() ){
+		printf( "%s: can't open serial port.\n", port->tty );
+		delete serialport;
+		return -1;
+	}
+	serialport->flush();
+	port->serial = serialport;
+	port->fd = serialport->getFd();
+	return 0;
+}
+
+static void portClose( port_t *port ){
+	if( port->serial != NULL ){
+		port->serial->close();
+		delete port->serial;
+		port->serial = NULL;
+	}
+	port->fd = -1;
+}
+
+/* After each call into the session: note its end or restart the timeout */
+static int portResult( port_t *port, int ret, int64_t now ){
+	if( ret != YM_SUCCESS ){
+		port->result = ret;
+		port->finished = now;
+		return 1;
+	}
+	if( !ymodem_wantRead( &port->ym ) ){
+		/* The timeout runs from the moment an answer is due */
+		port->deadline = now + PORT_TIMEOUT_MS;
+	}
+	return 0;
+}
+
+/*
+ * epoll transport. The ports are opened non-blocking, the sessions read and
+ * write the file descriptors directly, a full line takes 0 bytes.
+ */
+static int epfd = -1;
+
+/* 0 when the line is full */
+static int portWrite( port_t *port, const uint8_t *data, int size ){
+	while( 1 ){
+		syscalls ++;
+		ssize_t count = ::write( port->fd, data, size );
+		if( count >= 0 ){
+			return (int)count;
+		}
+		if( errno == EAGAIN || errno == EWOULDBLOCK ){
+			return 0;
+		}
+		if( errno != EINTR ){
+			return -1;
+		}
+	}
+}
+
+/* 0 when there is nothing to read */
+static int portRead( port_t *port, uint8_t *data, int size ){
+	while( 1 ){
+		syscalls ++;
+		ssize_t count = ::read( port->fd, data, size );
+		if( count > 0 ){
+			return (int)count;
+		}
+		if( count == 0 ){
+			/* Hung up */
+			return -1;
+		}
+		if( errno == EAGAIN || errno == EWOULDBLOCK ){
+			return 0;
+		}
+		if( errno != EINTR ){
+			return -1;
+		}
+	}
+}
+
+static int putByte( ymodem_t *ym, uint8_t bdata ){
+	return portWrite( portOf( ym ), &bdata, 1 ) == 1 ? 1 : -1;
+}
+
+static int putBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	return portWrite( portOf( ym ), data, size );
+}
+
+static int getByte( ymodem_t *ym, int timeout ){
+	(void)timeout;
+	uint8_t bdata;
+	if( portRead( portOf( ym ), &bdata, 1 ) != 1 ){
+		return -1;
+	}
+	return bdata;
+}
+
+static int getBlock( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	(void)timeout;
+	return portRead( portOf( ym ), data, size );
+}
+
+static int epollInit( int count ){
+	(void)count;
+	epfd = epoll_create1( EPOLL_CLOEXEC );
+	if( epfd < 0 ){
+		printf( "Can't create epoll, %s.\n", strerror( errno ) );
+		return -1;
+	}
+	return 0;
+}
+
+static void epollFini( void ){
+	::close( epfd );
+	epfd = -1;
+}
+
+/* End the session or follow what it waits for */
+static int epollUpdate( port_t *port, int ret, int64_t now ){
+	if( portResult( port, ret, now ) ){
+		if( port->events != 0 ){
+			syscalls ++;
+			epoll_ctl( epfd, EPOLL_CTL_DEL, port->fd, NULL );
+			port->events = 0;
+		}
+		return 1;
+	}
+
+	uint32_t events = EPOLLIN | ( ymodem_wantWrite( &port->ym ) ? (uint32_t)EPOLLOUT : 0u );
+	if( events != port->events ){
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.ptr = port;
+		syscalls ++;
+		if( epoll_ctl( epfd, port->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, port->fd, &ev ) < 0 ){
+			printf( "%s: epoll_ctl failed, %s.\n", port->tty, strerror( errno ) );
+			return epollUpdate( port, YM_ERROR_COMM, now );
+		}
+		port->events = events;
+	}
+	return 0;
+}
+
+static int epollEvent( port_t *port, uint32_t events ){
+	int ret = YM_SUCCESS;
+
+	if( events & EPOLLIN ){
+		ret = ymodem_onReadable( &port->ym );
+	}
+	if( ret == YM_SUCCESS && ( events & ( EPOLLERR | EPOLLHUP ) ) ){
+		/* Device gone, what it sent last is taken above */
+		printf( "%s: hung up.\n", port->tty );
+		return YM_ERROR_COMM;
+	}
+	/* An answer often lets the next packet go, don't wait for EPOLLOUT */
+	if( ret == YM_SUCCESS && ( ( events & EPOLLOUT ) || ymodem_wantWrite( &port->ym ) ) ){
+		ret = ymodem_onWritable( &port->ym );
+	}
+	return ret;
+}
+
+static void epollRun( std::vector<port_t> &ports ){
+	struct epoll_event events[ PORT_EVENTS ];
+	int64_t now = nowMs();
+	int running = 0;
+
+	for( size_t idx=0; idx<ports.size(); ++idx ){
+		port_t *port = &ports[idx];
+		if( port->result == YM_SUCCESS ){
+			running += !epollUpdate( port, YM_SUCCESS, now );
+		}
+	}
+
+	while( running > 0 ){
+		int64_t wait = PORT_TIMEOUT_MS;
+		now = nowMs();
+		for( size_t idx=0; idx<ports.size(); ++idx ){
+			port_t *port = &ports[idx];
+			if( port->events != 0 && ymodem_wantRead( &port->ym ) && port->deadline - now < wait ){
+				wait = port->deadline - now;
+			}
+		}
+
+		syscalls ++;
+		int n = epoll_wait( epfd, events, PORT_EVENTS, wait > 0 ? (int)wait : 0 );
+		if( n < 0 ){
+			if( errno == EINTR ){
+				continue;
+			}
+			printf( "epoll_wait failed, %s.\n", strerror( errno ) );
+			break;
+		}
+
+		now = nowMs();
+		for( int idx=0; idx<n; ++idx ){
+			port_t *port = (port_t*)events[idx].data.ptr;
+			if( port->events == 0 ){
+				continue;
+			}
+			if( events[idx].events & EPOLLIN ){
+				port->deadline = now + PORT_TIMEOUT_MS;
+			}
+			running -= epollUpdate( port, epollEvent( port, events[idx].events ), now );
+		}
+
+		for( size_t idx=0; idx<ports.size(); ++idx ){
+			port_t *port = &ports[idx];
+			if( port->events != 0 && ymodem_wantRead( &port->ym ) && now >= port->deadline ){
+				port->deadline = now + PORT_TIMEOUT_MS;
+				running -= epollUpdate( port, ymodem_onTimer( &port->ym ), now );
+			}
+		}
+	}
+
+	for( size_t idx=0; idx<ports.size(); ++idx ){
+		port_t *port = &ports[idx];
+		if( port->events != 0 ){
+			/* Left over after an epoll error */
+			epoll_ctl( epfd, EPOLL_CTL_DEL, port->fd, NULL );
+			port->events = 0;
+		}
+	}
+}
+
+static const transport_t epollTransport = {
+	"epoll", putByte, putBlock, getByte, getBlock, epollInit, epollRun, epollFini
+};
+
+#if YM_DEMO_URING
+/*
+ * io_uring transport, without liburing. Every port keeps one read queued
+ * with a timeout linked to it for the protocol deadline, the sessions write
+ * into a buffer per port that goes out as one write. Everything queued in a
+ * round is submitted with the wait for the next completions, one
+ * io_uring_enter for all ports.
+ */
+#define URING_READ     0
+#define URING_WRITE    1
+#define URING_TIMEOUT  2
+#define URING_CANCEL   3
+#define URING_OP_MASK  3  /* in the user_data next to the port */
+
+typedef struct{
+	int      fd;
+	unsigned entries;
+	unsigned tail;        /* SQ tail, published on io_uring_enter */
+	unsigned inflight;    /* submitted or queued, not completed */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void    *sq_ring;
+	size_t   sq_size;
+	void    *cq_ring;
+	size_t   cq_size;
+	size_t   sqes_size;
+}uring_t;
+
+static uring_t ring;
+
+static int uringEnter( unsigned wait ){
+	unsigned submit = ring.tail - __atomic_load_n( ring.sq_head, __ATOMIC_ACQUIRE );
+
+	__atomic_store_n( ring.sq_tail, ring.tail, __ATOMIC_RELEASE );
+	syscalls ++;
+	int ret = (int)syscall( __NR_io_uring_enter, ring.fd, submit, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+	return ret < 0 ? -errno : ret;
+}
+
+static struct io_uring_sqe *uringSqe( port_t *port, int op ){
+	if( ring.tail - __atomic_load_n( ring.sq_head, __ATOMIC_ACQUIRE ) == ring.entries ){
+		/* Only with more ports than the ring was sized for */
+		uringEnter( 0 );
+	}
+
+	unsigned idx = ring.tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[ idx ];
+	memset( sqe, 0, sizeof(*sqe) );
+	sqe->user_data = (uint64_t)(uintptr_t)port | op;
+	ring.sq_array[ idx ] = idx;
+	ring.tail ++;
+	ring.inflight ++;
+	return sqe;
+}
+
+static void uringFini( void ){
+	if( ring.sqes != NULL ){
+		munmap( ring.sqes, ring.sqes_size );
+	}
+	if( ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring ){
+		munmap( ring.cq_ring, ring.cq_size );
+	}
+	if( ring.sq_ring != NULL ){
+		munmap( ring.sq_ring, ring.sq_size );
+	}
+	if( ring.fd >= 0 ){
+		::close( ring.fd );
+	}
+	memset( &ring, 0, sizeof(ring) );
+	ring.fd = -1;
+}
+
+static int uringInit( int count ){
+	struct io_uring_params params;
+	unsigned entries = 64;
+
+	/* Read, linked timeout, write and cancel of every port fit */
+	while( entries < (unsigned)count * 4 ){
+		entries <<= 1;
+	}
+	memset( &ring, 0, sizeof(ring) );
+	memset( &params, 0, sizeof(params) );
+	ring.fd = (int)syscall( __NR_io_uring_setup, entries, &params );
+	if( ring.fd < 0 ){
+		printf( "Can't set up io_uring, %s.\n", strerror( errno ) );
+		return -1;
+	}
+	if( !( params.features & IORING_FEAT_RW_CUR_POS ) ){
+		/* IORING_OP_READ/WRITE came with it, 5.6 */
+		printf( "io_uring is too old.\n" );
+		uringFini();
+		return -1;
+	}
+
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if( params.features & IORING_FEAT_SINGLE_MMAP ){
+		if( ring.cq_size > ring.sq_size ){
+			ring.sq_size = ring.cq_size;
+		}
+		ring.cq_size = ring.sq_size;
+	}
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	void *map = mmap( NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring.fd, IORING_OFF_SQ_RING );
+	ring.sq_ring = map == MAP_FAILED ? NULL : map;
+	if( params.features & IORING_FEAT_SINGLE_MMAP ){
+		ring.cq_ring = ring.sq_ring;
+	}
+	else if( ring.sq_ring != NULL ){
+		map = mmap( NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring.fd, IORING_OFF_CQ_RING );
+		ring.cq_ring = map == MAP_FAILED ? NULL : map;
+	}
+	if( ring.cq_ring != NULL ){
+		map = mmap( NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring.fd, IORING_OFF_SQES );
+		ring.sqes = map == MAP_FAILED ? NULL : (struct io_uring_sqe*)map;
+	}
+	if( ring.sqes == NULL ){
+		printf( "Can't map io_uring, %s.\n", strerror( errno ) );
+		uringFini();
+		return -1;
+	}
+
+	uint8_t *sq = (uint8_t*)ring.sq_ring;
+	uint8_t *cq = (uint8_t*)ring.cq_ring;
+	ring.sq_head = (unsigned*)( sq + params.sq_off.head );
+	ring.sq_tail = (unsigned*)( sq + params.sq_off.tail );
+	ring.sq_mask = (unsigned*)( sq + params.sq_off.ring_mask );
+	ring.sq_array = (unsigned*)( sq + params.sq_off.array );
+	ring.cq_head = (unsigned*)( cq + params.cq_off.head );
+	ring.cq_tail = (unsigned*)( cq + params.cq_off.tail );
+	ring.cq_mask = (unsigned*)( cq + params.cq_off.ring_mask );
+	ring.cqes = (struct io_uring_cqe*)( cq + params.cq_off.cqes );
+	ring.entries = params.sq_entries;
+	ring.tail = *ring.sq_tail;
+	return 0;
+}
+
+/* The session writes into the port buffer, 0 when it is full */
+static int uringPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	port_t *port = portOf( ym );
+	int count = (int)sizeof(port->out) - port->out_len;
+	if( count > size ){
+		count = size;
+	}
+	memcpy( port->out + port->out_len, data, count );
+	port->out_len += count;
+	return count;
+}
+
+static int uringPutByte( ymodem_t *ym, uint8_t bdata ){
+	return uringPutBlock( ym, &bdata, 1 ) == 1 ? 1 : -1;
+}
+
+/* Takes from the last read completed */
+static int uringGetBlock( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	(void)timeout;
+	port_t *port = portOf( ym );
+	int count = port->in_len - port->in_pos;
+	if( count > size ){
+		count = size;
+	}
+	memcpy( data, port->in + port->in_pos, count );
+	port->in_pos += count;
+	return count;
+}
+
+static int uringGetByte( ymodem_t *ym, int timeout ){
+	uint8_t bdata;
+	if( uringGetBlock( ym, &bdata, 1, timeout ) != 1 ){
+		return -1;
+	}
+	return bdata;
+}
+
+/* The read ends with -ECANCELED when its timeout fires first */
+static void uringRead( port_t *port, int64_t now ){
+	int64_t wait = PORT_TIMEOUT_MS;
+	if( ymodem_wantRead( &port->ym ) ){
+		wait = port->deadline - now;
+		if( wait < 0 ){
+			wait = 0;
+		}
+	}
+	port->ts.tv_sec = wait / 1000;
+	port->ts.tv_nsec = ( wait % 1000 ) * 1000000;
+
+	struct io_uring_sqe *sqe = uringSqe( port, URING_READ );
+	sqe->opcode = IORING_OP_READ;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = port->fd;
+	sqe->addr = (uintptr_t)port->in;
+	sqe->len = sizeof(port->in);
+	sqe->off = (uint64_t)-1;
+
+	sqe = uringSqe( port, URING_TIMEOUT );
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (uintptr_t)&port->ts;
+	sqe->len = 1;
+	port->reading = 1;
+}
+
+static void uringWrite( port_t *port ){
+	struct io_uring_sqe *sqe = uringSqe( port, URING_WRITE );
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = port->fd;
+	sqe->addr = (uintptr_t)port->out;
+	sqe->len = port->out_len;
+	sqe->off = (uint64_t)-1;
+	port->writing = port->out_len;
+}
+
+static void uringCancel( port_t *port ){
+	struct io_uring_sqe *sqe = uringSqe( port, URING_CANCEL );
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)(uintptr_t)port | URING_READ;
+	port->cancel = 1;
+}
+
+/* Let the session fill the write buffer, then queue what the port needs */
+static int uringUpdate( port_t *port, int ret, int64_t now ){
+	int ended = 0;
+
+	if( port->result == YM_SUCCESS ){
+		if( ret == YM_SUCCESS && ymodem_wantWrite( &port->ym ) && port->out_len < (int)sizeof(port->out) ){
+			ret = ymodem_onWritable( &port->ym );
+		}
+		ended = portResult( port, ret, now );
+	}
+	/* Also what the session wrote last, a CA */
+	if( port->writing == 0 && port->out_len > 0 ){
+		uringWrite( port );
+	}
+	if( port->result == YM_SUCCESS ){
+		if( !port->reading ){
+			uringRead( port, now );
+		}
+	}
+	else if( port->reading && !port->cancel ){
+		uringCancel( port );
+	}
+	return ended;
+}
+
+static int uringComplete( port_t *port, int op, int res, int64_t now ){
+	int ret = YM_SUCCESS;
+
+	switch( op ){
+	case URING_READ:
+		port->reading = 0;
+		port->cancel = 0;
+		if( port->result != YM_SUCCESS ){
+			break;
+		}
+		if( res > 0 ){
+			port->in_len = res;
+			port->in_pos = 0;
+			port->deadline = now + PORT_TIMEOUT_MS;
+			ret = ymodem_onReadable( &port->ym );
+		}
+		else if( res == -ECANCELED ){
+			if( ymodem_wantRead( &port->ym ) && now >= port->deadline ){
+				port->deadline = now + PORT_TIMEOUT_MS;
+				ret = ymodem_onTimer( &port->ym );
+			}
+		}
+		else if( res != -EINTR && res != -EAGAIN ){
+			printf( "%s: %s.\n", port->tty, res == 0 ? "hung up" : strerror( -res ) );
+			ret = YM_ERROR_COMM;
+		}
+		break;
+	case URING_WRITE:
+		if( res == -EINTR || res == -EAGAIN ){
+			/* Cancelling a read on the same tty can interrupt the write,
+			 * nothing went out, it is submitted again below */
+		}
+		else if( res <= 0 ){
+			if( port->result == YM_SUCCESS ){
+				printf( "%s: write failed, %s.\n", port->tty, strerror( -res ) );
+			}
+			port->out_len = 0;
+			ret = YM_ERROR_COMM;
+		}
+		else{
+			port->out_len -= res;
+			memmove( port->out, port->out + res, port->out_len );
+		}
+		port->writing = 0;
+		break;
+	default:
+		/* Linked timeouts and cancels, their reads tell */
+		return 0;
+	}
+	return uringUpdate( port, ret, now );
+}
+
+static void uringRun( std::vector<port_t> &ports ){
+	int64_t now = nowMs();
+	int running = 0;
+
+	for( size_t idx=0; idx<ports.size(); ++idx ){
+		port_t *port = &ports[idx];
+		if( port->result == YM_SUCCESS ){
+			/* io_uring waits for the data itself, a non-blocking fd would
+			 * only give -EAGAIN back */
+			fcntl( port->fd, F_SETFL, fcntl( port->fd, F_GETFL ) & ~O_NONBLOCK );
+			running += !uringUpdate( port, YM_SUCCESS, now );
+		}
+	}
+
+	while( running > 0 || ring.inflight > 0 ){
+		int ret = uringEnter( 1 );
+		if( ret < 0 && ret != -EINTR && ret != -EBUSY ){
+			printf( "io_uring_enter failed, %s.\n", strerror( -ret ) );
+			break;
+		}
+
+		now = nowMs();
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n( ring.cq_tail, __ATOMIC_ACQUIRE );
+		for( ; head != tail; ++head ){
+			struct io_uring_cqe *cqe = &ring.cqes[ head & *ring.cq_mask ];
+			port_t *port = (port_t*)(uintptr_t)( cqe->user_data & ~(uint64_t)URING_OP_MASK );
+			ring.inflight --;
+			running -= uringComplete( port, (int)( cqe->user_data & URING_OP_MASK ), cqe->res, now );
+		}
+		__atomic_store_n( ring.cq_head, head, __ATOMIC_RELEASE );
+	}
+}
+
+static const transport_t uringTransport = {
+	"io_uring", uringPutByte, uringPutBlock, uringGetByte, uringGetBlock, uringInit, uringRun, uringFini
+};
+#endif
+
+static void report( const std::vector<port_t> &ports, const transport_t *transport,
+		int64_t start, int64_t end, int64_t cpu ){
+	uint64_t total = 0;
+	uint64_t sent = 0;
+	int64_t last = start;  /* the last port done, failed ports don't hold it back */
+	int done = 0;
+
+	printf( "-------------------------------\n" );
+	for( size_t idx=0; idx<ports.size(); ++idx ){
+		const port_t *port = &ports[idx];
+		double secs = ( port->finished - start ) / 1000.0;
+		sent += port->offset;
+		if( port->result == YM_DONE ){
+			done ++;
+			total += port->offset;
+			if( port->finished > last ){
+				last = port->finished;
+			}
+		}
+		printf( "%s: %s", port->tty, port->result == YM_DONE ? "done" : "failed" );
+		if( port->result != YM_DONE ){
+			printf( " (%d)", port->result );
+		}
+		printf( ", %zu bytes in %.2fs, %u packets, %u resends, %u timeouts\n",
+				port->offset, secs, port->ym.stats.packets,
+				port->ym.stats.resends, port->ym.stats.timeouts );
+	}
+
+	double secs = ( last - start ) / 1000.0;
+	printf( "-------------------------------\n" );
+	printf( "%d of %zu ports done, %llu bytes in %.2fs", done, ports.size(),
+			(unsigned long long)total, secs );
+	if( secs > 0 ){
+		printf( ", %.1f KB/s aggregate", total / 1024.0 / secs );
+	}
+	printf( ", %.2fs total\n", ( end - start ) / 1000.0 );
+
+	double mb = sent / 1048576.0;
+	printf( "%s: %llu syscalls, %.2fms CPU", transport->name,
+			(unsigned long long)syscalls, cpu / 1000.0 );
+	if( mb > 0 ){
+		printf( ", %.0f syscalls and %.2fms CPU per MB", syscalls / mb, cpu / 1000.0 / mb );
+	}
+	printf( "\n" );
+}
+
+int multiportSend( const char *filename, char * const ttys[], int count, int uring ){
+	const transport_t *transport = &epollTransport;
+
+	printf( "\n" );
+	printf( "===============================\n" );
+	printf( "YModem send to %d ports:\n", count );
+	printf( "  file  : %s\n", filename );
+	printf( "-------------------------------\n" );
+
+	int file = ::open( filename, O_RDONLY | O_CLOEXEC );
+	struct stat st;
+	if( file < 0 || fstat( file, &st ) < 0 ){
+		printf( "Can't open input file.\n" );
+		if( file >= 0 ){
+			::close( file );
+		}
+		return -1;
+	}
+	image_size = st.st_size;
+	image = NULL;
+	if( image_size > 0 ){
+		void *map = mmap( NULL, image_size, PROT_READ, MAP_PRIVATE, file, 0 );
+		if( map == MAP_FAILED ){
+			printf( "Can't map input file.\n" );
+			::close( file );
+			return -1;
+		}
+		image = (const uint8_t*)map;
+	}
+	::close( file );
+
+	int ready = -1;
+#if YM_DEMO_URING
+	if( uring ){
+		ready = uringTransport.init( count );
+		if( ready == 0 ){
+			transport = &uringTransport;
+		}
+	}
+#endif
+	if( ready < 0 ){
+		if( uring ){
+			printf( "io_uring not available, using epoll.\n" );
+		}
+		if( epollTransport.init( count ) < 0 ){
+			if( image != NULL ){
+				munmap( (void*)image, image_size );
+			}
+			return -1;
+		}
+	}
+
+	std::vector<port_t> ports( count );
+	int64_t start = nowMs();
+	for( int idx=0; idx<count; ++idx ){
+		port_t *port = &ports[idx];
+		memset( port, 0, sizeof(*port) );
+		port->tty = ttys[idx];
+		port->fd = -1;
+		port->finished = start;
+		port->result = YM_ERROR_COMM;
+		if( portOpen( port ) < 0 ){
+			continue;
+		}
+		port->result = YM_SUCCESS;
+
+		ymodem_t *ym = &port->ym;
+		ym->config.num_of_retry = 5;
+		ym->config.putByte = transport->putByte;
+		ym->config.putBlock = transport->putBlock;
+		ym->config.getByte = transport->getByte;
+		ym->config.getBlock = transport->getBlock;
+		ym->config.readData = readData;
+		ym->config.timeout = 5;
+		ym->config.options = YM_OPT_PIPELINE;
+		ymodem_init( ym );
+		portResult( port, ymodem_pollTransmit( ym, filename, PORT_HEADER_TRY ), start );
+	}
+
+	syscalls = 0;
+	int64_t cpu = cpuUs();
+	transport->run( ports );
+	cpu = cpuUs() - cpu;
+	int64_t end = nowMs();
+	transport->fini();
+
+	int failed = 0;
+	for( size_t idx=0; idx<ports.size(); ++idx ){
+		port_t *port = &ports[idx];
+		if( port->result == YM_SUCCESS ){
+			/* Left over after a transport error */
+			port->result = YM_ERROR_COMM;
+			port->finished = end;
+		}
+		if( port->result != YM_DONE ){
+			failed ++;
+		}
+		portClose( port );
+	}
+	if( image != NULL ){
+		munmap( (void*)image, image_size );
+	}
+
+	report( ports, transport, start, end, cpu );
+	return failed;
+}
@@ -0,0 +1,13 @@
+#ifndef __MULTIPORT_H_
+#define __MULTIPORT_H_
+
+/*
+ * Send one file to several ports at once from a single thread, each port
+ * runs its own YModem session. Linux only, the ports are driven by epoll,
+ * or by io_uring when uring is set and the kernel has it. Prints the
+ * syscalls and CPU time per MB of either to compare them.
+ * Returns the number of ports that failed, -1 if nothing could be started.
+ */
+int multiportSend( const char *filename, char * const ttys[], int count, int uring );
+
+#endif  /* __MULTIPORT_H_ */
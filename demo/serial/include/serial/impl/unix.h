@@ -107,6 +107,15 @@ public:
   void
   flushOutput ();
 
+  void
+  setWriteCoalescing (bool enabled);
+
+  bool
+  getWriteCoalescing () const;
+
+  void
+  flushWrites ();
+
   void
   sendBreak (int duration);
 
@@ -140,6 +149,9 @@ public:
   string
   getPort () const;
 
+  int
+  getFd () const;
+
   void
   setTimeout (Timeout &timeout);
 
@@ -191,6 +203,12 @@ public:
 protected:
   void reconfigurePort ();
 
+  size_t takeReadAhead (uint8_t *buf, size_t size);
+
+  ssize_t readDevice (uint8_t *buf, size_t size);
+
+  size_t writeDevice (const uint8_t *data, size_t length);
+
 private:
   string port_;               // Path to the file descriptor
   int fd_;                    // The current file descriptor
@@ -208,6 +226,17 @@ private:
   stopbits_t stopbits_;       // Stop Bits
   flowcontrol_t flowcontrol_; // Flow Control
 
+  // Bytes read from the device ahead of the caller, small reads are served
+  // from here without a syscall
+  uint8_t read_ahead_[4096];
+  size_t read_ahead_pos_;
+  size_t read_ahead_len_;
+
+  // Small writes collected until a flush point, with coalescing on
+  bool write_coalesce_;
+  uint8_t write_buffer_[4096];
+  size_t write_pending_;
+
   // Mutex used to lock the read functions
   pthread_mutex_t read_mutex;
   // Mutex used to lock the write functions
@@ -252,6 +252,9 @@ public:
    *      occur.
    *  * An exception occurred, in this case an actual exception will be thrown.
    *
+   * On unix small reads take whatever the port has, up to a few KB, and
+   * serve the following reads from memory until it is used up.
+   *
    * \param buffer An uint8_t array of at least the requested size.
    * \param size A size_t defining how many bytes to be read.
    *
@@ -421,6 +424,18 @@ public:
   std::string
   getPort () const;
 
+#if !defined(_WIN32)
+  /*! Gets the file descriptor of the open port, -1 if it is closed.
+   *
+   * The port is opened non-blocking, the descriptor can be watched with
+   * select, poll or epoll and read or written directly to drive several
+   * ports from one thread. Don't mix that with Serial::read, which keeps
+   * bytes read ahead from the descriptor.
+   */
+  int
+  getFd () const;
+#endif
+
   /*! Sets the timeout for reads and writes using the Timeout struct.
    *
    * There are two timeout conditions described here:
@@ -596,6 +611,31 @@ public:
   void
   flushOutput ();
 
+#if !defined(_WIN32)
+  /*! Sets write coalescing, off by default.
+   *
+   * Small writes then go into an output buffer instead of to the port one
+   * by one. The buffer is written out when it is full, before a read waits
+   * for data, and on flushWrites or flush. Turning it off writes out what
+   * is left.
+   */
+  void
+  setWriteCoalescing (bool enabled);
+
+  /*! Gets the write coalescing setting.
+   *
+   * \see Serial::setWriteCoalescing
+   */
+  bool
+  getWriteCoalescing () const;
+
+  /*! Writes out what write coalescing holds, e.g. at the end of a packet.
+   * Returns at the write timeout, the rest stays buffered.
+   */
+  void
+  flushWrites ();
+#endif
+
   /*! Sends the RS-232 break signal.  See tcsendbreak(3). */
   void
   sendBreak (int duration);
@@ -111,7 +111,9 @@ Serial::SerialImpl::SerialImpl (const string &port, unsigned long baudrate,
                                 flowcontrol_t flowcontrol)
   : port_ (port), fd_ (-1), is_open_ (false), xonxoff_ (false), rtscts_ (false),
     baudrate_ (baudrate), parity_ (parity),
-    bytesize_ (bytesize), stopbits_ (stopbits), flowcontrol_ (flowcontrol)
+    bytesize_ (bytesize), stopbits_ (stopbits), flowcontrol_ (flowcontrol),
+    read_ahead_pos_ (0), read_ahead_len_ (0),
+    write_coalesce_ (false), write_pending_ (0)
 {
   pthread_mutex_init(&this->read_mutex, NULL);
   pthread_mutex_init(&this->write_mutex, NULL);
@@ -456,6 +458,11 @@ Serial::SerialImpl::close ()
 {
   if (is_open_ == true) {
     if (fd_ != -1) {
+      // Best effort for what coalescing still holds, close anyway
+      try {
+        flushWrites ();
+      } catch (...) {
+      }
       int ret;
       ret = ::close (fd_);
       if (ret == 0) {
@@ -466,6 +473,8 @@ Serial::SerialImpl::close ()
     }
     is_open_ = false;
   }
+  read_ahead_pos_ = read_ahead_len_ = 0;
+  write_pending_ = 0;
 }
 
 bool
@@ -484,13 +493,28 @@ Serial::SerialImpl::available ()
   if (-1 == ioctl (fd_, TIOCINQ, &count)) {
       THROW (IOException, errno);
   } else {
-      return static_cast<size_t> (count);
+      return static_cast<size_t> (count) + (read_ahead_len_ - read_ahead_pos_);
   }
 }
 
 bool
 Serial::SerialImpl::waitReadable (uint32_t timeout)
 {
+  // Read ahead already
+  if (read_ahead_pos_ < read_ahead_len_) {
+    return true;
+  }
+  // About to block, the other side may wait for what is buffered
+  if (write_coalesce_) {
+    writeLock ();
+    try {
+      flushWrites ();
+    } catch (...) {
+      writeUnlock ();
+      throw;
+    }
+    writeUnlock ();
+  }
   // Setup a select call to block for serial data or a timeout
   fd_set readfds;
   FD_ZERO (&readfds);
@@ -533,7 +557,12 @@ Serial::SerialImpl::read (uint8_t *buf, size_t size)
   if (!is_open_) {
     throw PortNotOpenedException ("Serial::read");
   }
-  size_t bytes_read = 0;
+  // Bytes read ahead by an earlier call come first, no syscall if they
+  // are enough
+  size_t bytes_read = takeReadAhead (buf, size);
+  if (bytes_read == size) {
+    return bytes_read;
+  }
 
   // Calculate total timeout in milliseconds t_c + (t_m * N)
   long total_timeout_ms = timeout_.read_timeout_constant;
@@ -542,9 +571,9 @@ Serial::SerialImpl::read (uint8_t *buf, size_t size)
 
   // Pre-fill buffer with available bytes
   {
-    ssize_t bytes_read_now = ::read (fd_, buf, size);
+    ssize_t bytes_read_now = readDevice (buf + bytes_read, size - bytes_read);
     if (bytes_read_now > 0) {
-      bytes_read = bytes_read_now;
+      bytes_read += bytes_read_now;
     }
   }
 
@@ -572,7 +601,7 @@ Serial::SerialImpl::read (uint8_t *buf, size_t size)
       // This should be non-blocking returning only what is available now
       //  Then returning so that select can block again.
       ssize_t bytes_read_now =
-        ::read (fd_, buf + bytes_read, size - bytes_read);
+        readDevice (buf + bytes_read, size - bytes_read);
       // read should always return some data as select reported it was
       // ready to read when we get to this point.
       if (bytes_read_now < 1) {
@@ -603,12 +632,60 @@ Serial::SerialImpl::read (uint8_t *buf, size_t size)
   return bytes_read;
 }
 
+size_t
+Serial::SerialImpl::takeReadAhead (uint8_t *buf, size_t size)
+{
+  size_t count = std::min (size, read_ahead_len_ - read_ahead_pos_);
+  memcpy (buf, read_ahead_ + read_ahead_pos_, count);
+  read_ahead_pos_ += count;
+  return count;
+}
+
+// Non-blocking read of what the device has. Small reads take up to a
+// whole read-ahead buffer and keep the rest for the next calls, large ones
+// go straight to the caller. Only called with the read-ahead drained.
+ssize_t
+Serial::SerialImpl::readDevice (uint8_t *buf, size_t size)
+{
+  if (size >= sizeof (read_ahead_)) {
+    return ::read (fd_, buf, size);
+  }
+  ssize_t count = ::read (fd_, read_ahead_, sizeof (read_ahead_));
+  if (count <= 0) {
+    return count;
+  }
+  read_ahead_pos_ = 0;
+  read_ahead_len_ = static_cast<size_t> (count);
+  return static_cast<ssize_t> (takeReadAhead (buf, size));
+}
+
 size_t
 Serial::SerialImpl::write (const uint8_t *data, size_t length)
 {
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::write");
   }
+  if (!write_coalesce_) {
+    return writeDevice (data, length);
+  }
+
+  if (write_pending_ + length > sizeof (write_buffer_)) {
+    flushWrites ();
+  }
+  // Too large to gain from the buffer
+  if (write_pending_ == 0 && length >= sizeof (write_buffer_)) {
+    return writeDevice (data, length);
+  }
+  // Takes less only if the flush above timed out
+  size_t count = std::min (length, sizeof (write_buffer_) - write_pending_);
+  memcpy (write_buffer_ + write_pending_, data, count);
+  write_pending_ += count;
+  return count;
+}
+
+size_t
+Serial::SerialImpl::writeDevice (const uint8_t *data, size_t length)
+{
   fd_set writefds;
   size_t bytes_written = 0;
 
@@ -698,6 +775,12 @@ Serial::SerialImpl::getPort () const
   return port_;
 }
 
+int
+Serial::SerialImpl::getFd () const
+{
+  return is_open_ ? fd_ : -1;
+}
+
 void
 Serial::SerialImpl::setTimeout (serial::Timeout &timeout)
 {
@@ -786,6 +869,7 @@ Serial::SerialImpl::flush ()
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::flush");
   }
+  flushWrites ();
   tcdrain (fd_);
 }
 
@@ -796,6 +880,7 @@ Serial::SerialImpl::flushInput ()
     throw PortNotOpenedException ("Serial::flushInput");
   }
   tcflush (fd_, TCIFLUSH);
+  read_ahead_pos_ = read_ahead_len_ = 0;
 }
 
 void
@@ -805,6 +890,33 @@ Serial::SerialImpl::flushOutput ()
     throw PortNotOpenedException ("Serial::flushOutput");
   }
   tcflush (fd_, TCOFLUSH);
+  write_pending_ = 0;
+}
+
+void
+Serial::SerialImpl::setWriteCoalescing (bool enabled)
+{
+  if (!enabled && is_open_) {
+    flushWrites ();
+  }
+  write_coalesce_ = enabled;
+}
+
+bool
+Serial::SerialImpl::getWriteCoalescing () const
+{
+  return write_coalesce_;
+}
+
+void
+Serial::SerialImpl::flushWrites ()
+{
+  if (write_pending_ == 0) {
+    return;
+  }
+  size_t written = writeDevice (write_buffer_, write_pending_);
+  write_pending_ -= written;
+  memmove (write_buffer_, write_buffer_ + written, write_pending_);
 }
 
 void
@@ -278,6 +278,14 @@ Serial::getPort () const
   return pimpl_->getPort ();
 }
 
+#if !defined(_WIN32)
+int
+Serial::getFd () const
+{
+  return pimpl_->getFd ();
+}
+#endif
+
 void
 Serial::setTimeout (serial::Timeout &timeout)
 {
@@ -368,6 +376,25 @@ void Serial::flushOutput ()
   pimpl_->flushOutput ();
 }
 
+#if !defined(_WIN32)
+void Serial::setWriteCoalescing (bool enabled)
+{
+  ScopedWriteLock lock(this->pimpl_);
+  pimpl_->setWriteCoalescing (enabled);
+}
+
+bool Serial::getWriteCoalescing () const
+{
+  return pimpl_->getWriteCoalescing ();
+}
+
+void Serial::flushWrites ()
+{
+  ScopedWriteLock lock(this->pimpl_);
+  pimpl_->flushWrites ();
+}
+#endif
+
 void Serial::sendBreak (int duration)
 {
   pimpl_->sendBreak (duration);
@@ -6,6 +6,7 @@ extern "C"{
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
 
 typedef enum
 {
@@ -28,6 +29,7 @@ typedef enum
 #define PACKET_NUMBER_INDEX     ((uint32_t)2)
 #define PACKET_CNUMBER_INDEX    ((uint32_t)3)
 #define PACKET_TRAILER_SIZE     ((uint32_t)2)
+#define PACKET_CRC32_SIZE       ((uint32_t)4)    /* trailer of a large packet */
 #define PACKET_OVERHEAD_SIZE    (PACKET_HEADER_SIZE + PACKET_TRAILER_SIZE - 1)
 #define PACKET_SIZE             ((uint32_t)128)
 #define PACKET_1K_SIZE          ((uint32_t)1024)
@@ -44,11 +46,15 @@ typedef enum
 
 #define SOH                     ((uint8_t)0x01)  /* start of 128-byte data packet */
 #define STX                     ((uint8_t)0x02)  /* start of 1024-byte data packet */
+#define STX_LARGE               ((uint8_t)0x03)  /* start of a negotiated large packet, CRC32 */
 #define EOT                     ((uint8_t)0x04)  /* end of transmission */
 #define ACK                     ((uint8_t)0x06)  /* acknowledge */
 #define NAK                     ((uint8_t)0x15)  /* negative acknowledge */
 #define CA                      ((uint32_t)0x18) /* two of these in succession aborts transfer */
 #define CRC16                   ((uint8_t)0x43)  /* 'C' == 0x43, request 16-bit CRC */
+#define YMODEM_G                ((uint8_t)0x47)  /* 'G' == 0x47, request YModem-g streaming */
+#define YMODEM_W                ((uint8_t)0x57)  /* 'W' == 0x57, request windowed transfer */
+#define YMODEM_L                ((uint8_t)0x4C)  /* 'L' == 0x4C, large packets accepted, size in KB follows */
 #define NEGATIVE_BYTE           ((uint8_t)0xFF)
 
 #define ABORT1                  ((uint8_t)0x41)  /* 'A' == 0x41, abort by user */
@@ -67,23 +73,278 @@ COM_StatusTypeDef Ymodem_Transmit(uint8_t *p_buf, const uint8_t *p_file_name, ui
 
 
 #define YM_SUCCESS                  (0)
+#define YM_DONE                     (1)  /* Receive session finished */
 #define YM_ERROR_TIMEOUT            (-1)
 #define YM_ERROR_FILENAME_TOO_LONG  (-2)
 #define YM_ERROR_STATE              (-3)
 #define YM_ERROR_ABORT              (-4) /* Remote abort */
 #define YM_ERROR_COMM               (-5) /* Protocal error */
+#define YM_ERROR_WRITE              (-6) /* The receive sink failed */
+#define YM_ERROR_READ               (-7) /* readData failed */
 
 #define YM_PACKET_SIZE_128  (128)
 #define YM_PACKET_SIZE_1K   (1024)
+#define YM_PACKET_SIZE_4K   (4096)
+#define YM_PACKET_SIZE_32K  (32768)
+
+/* Packet size policy */
+#define YM_POLICY_1K           (0) /* Only 1K-packets until the final flush (default) */
+#define YM_POLICY_EAGER        (1) /* 128B-packet as soon as 128 bytes are buffered */
+
+/* Session options */
+#define YM_OPT_PIPELINE        (1<<0) /* Prepare the next packet while the ACK is pending */
+#define YM_OPT_STREAMING       (1<<1) /* YModem-g: the sender accepts 'G', the receiver
+                                       * requests it. Packets are not ACKed, any error
+                                       * aborts the transfer, for error-free links only.
+                                       * A request not answered falls back to 'C' */
+#define YM_OPT_WINDOW          (1<<2) /* Sliding window: the sender accepts 'W', the receiver
+                                       * requests it. Up to config.window packets are in
+                                       * flight, each answered by ACK/NAK and its packet
+                                       * number, only NAKed packets are sent again.
+                                       * A request not answered falls back to 'C' */
+#define YM_OPT_ADAPTIVE        (1<<3) /* Pick the packet size from the recent NAK and
+                                       * timeout rate, see ym_stats_t */
+
+/* Packets in flight in windowed mode, one more packet buffer than this is used */
+#ifndef YM_WINDOW_MAX
+#define YM_WINDOW_MAX          (4)
+#endif
+#if YM_WINDOW_MAX < 1 || YM_WINDOW_MAX > 64
+#error "YM_WINDOW_MAX must be 1..64"
+#endif
+
+/* Largest packet the receiver accepts, its buffer shares the memory of the
+ * packet buffers and grows ymodem_t only when it is bigger than those */
+#ifndef YM_LARGE_MAX
+#define YM_LARGE_MAX           YM_PACKET_SIZE_4K
+#endif
+#if YM_LARGE_MAX < YM_PACKET_SIZE_4K || YM_LARGE_MAX > YM_PACKET_SIZE_32K || ( YM_LARGE_MAX & ( YM_LARGE_MAX-1 ) ) != 0
+#error "YM_LARGE_MAX must be a power of two from 4K to 32K"
+#endif
 
 /* State mechine define */
 #define YM_STATE_INIT          (0)
 #define YM_STATE_READY         (1)
 #define YM_STATE_TRANSMITING   (2)
 #define YM_STATE_RECEIVING     (3)
+#define YM_STATE_POLLING       (4) /* non-blocking transmit */
+
+/* CRC16 (ymodem_crc.c) */
+uint16_t UpdateCRC16( uint16_t crc_in, uint8_t byte );
+uint16_t Cal_CRC16_Bitwise( const uint8_t *p_data, uint32_t size );
+uint16_t Cal_CRC16_Table( uint16_t crc, const uint8_t *p_data, uint32_t size );
+uint16_t Cal_CRC16_Update( uint16_t crc, const uint8_t *p_data, uint32_t size );
+uint16_t Cal_CRC16_Copy( uint16_t crc, uint8_t *p_dest, const uint8_t *p_data, uint32_t size );
+uint16_t Cal_CRC16( const uint8_t *p_data, uint32_t size );
+uint32_t Cal_CRC32_Update( uint32_t crc, const uint8_t *p_data, uint32_t size );
+uint32_t Cal_CRC32( const uint8_t *p_data, uint32_t size );
+
+/* Receiver resync (ymodem_scan.c) */
+int Scan_Packet_Start( const uint8_t *p_data, int size, int large );
 
 typedef struct YModem ymodem_t;
 
+/* A packet on the wire: header, payload in one or two pieces, CRC16, or
+ * CRC32 for a large packet. When frame is set the whole packet is
+ * contiguous there. */
+typedef struct{
+	const uint8_t *frame;
+	uint8_t header[ PACKET_HEADER_SIZE ];
+	const uint8_t *seg[2];
+	int     seg_len[2];
+	uint8_t trailer[ PACKET_CRC32_SIZE ];
+	int     trailer_len;
+}ym_frame_t;
+
+/* A sent packet waiting for its ACK */
+typedef struct{
+	ym_frame_t frame;
+	int     retry;
+	int     acked;
+}ym_pending_t;
+
+/* error_rate of 1, every send failed */
+#define YM_ERROR_RATE_ONE      (65536)
+
+/* Transmit statistics, kept from ymodem_init on */
+typedef struct{
+	uint32_t packets;     /* packets acknowledged */
+	uint32_t resends;     /* packets sent again */
+	uint32_t naks;        /* NAKs received */
+	uint32_t timeouts;    /* no or unexpected answer */
+	uint32_t error_rate;  /* recent share of failed sends, of YM_ERROR_RATE_ONE */
+	int      packet_size; /* largest data packet in use, chosen by YM_OPT_ADAPTIVE */
+}ym_stats_t;
+
+/*
+ * Receive sink, where received files go. The receive engine calls open for
+ * each file header, write for the file data in order, finish after the EOT
+ * and abort when the transfer ends inside a file. Except for abort they
+ * return 0 on success, -1 cancels the transfer.
+ */
+typedef struct ym_sink ym_sink_t;
+typedef struct{
+	/* @param name from the file header, "" without a filename buffer
+	 * @param size from the file header, 0: unknown */
+	int  (*open)( ym_sink_t *sink, const char *name, uint32_t size );
+	/* Without a file size in the header the padding of the last packet
+	 * is written too */
+	int  (*write)( ym_sink_t *sink, uint32_t offset, const uint8_t *data, int size );
+	/* @param size bytes written, the final file size */
+	int  (*finish)( ym_sink_t *sink, uint32_t size );
+	void (*abort)( ym_sink_t *sink );
+}ym_sink_ops_t;
+
+struct ym_sink{
+	const ym_sink_ops_t *ops;
+};
+
+/* Keeps the last file received in a caller buffer */
+typedef struct{
+	ym_sink_t sink;
+	uint8_t  *buffer;
+	uint32_t  capacity;
+	uint32_t  size;       /* bytes of the file */
+	int       complete;   /* finished after EOT */
+}ym_mem_sink_t;
+
+/* Drops the data, counts it */
+typedef struct{
+	ym_sink_t sink;
+	uint32_t  files;
+	uint32_t  bytes;
+}ym_null_sink_t;
+
+/* Writes each file with stdio */
+typedef struct{
+	ym_sink_t   sink;
+	const char *path;     /* every file goes here, NULL: the name from the
+	                       * header, without its directories */
+	FILE       *fp;
+	uint32_t    pos;      /* file position of fp */
+}ym_file_sink_t;
+
+/* Memory maps each file, preallocated from the size in the header */
+#ifndef YM_SINK_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define YM_SINK_MMAP 1
+#else
+#define YM_SINK_MMAP 0
+#endif
+#endif
+
+#if YM_SINK_MMAP
+typedef struct{
+	ym_sink_t   sink;
+	const char *path;     /* every file goes here, NULL: the name from the
+	                       * header, without its directories */
+	int         fd;
+	uint8_t    *map;      /* the whole file, NULL: size unknown, pwrite */
+	uint32_t    map_size;
+}ym_mmap_sink_t;
+#endif
+
+/*
+ * Runs another sink on a writer thread. Writes are copied into a bounded
+ * single producer, single consumer ring and return at once, so the packet
+ * is answered without waiting for the disk. open, finish and abort wait
+ * for the ring to drain. A failed write shows at the next call, which
+ * cancels the transfer.
+ */
+#ifndef YM_SINK_ASYNC
+#if defined(__linux__)
+#define YM_SINK_ASYNC 1
+#else
+#define YM_SINK_ASYNC 0
+#endif
+#endif
+
+#if YM_SINK_ASYNC
+#include <pthread.h>
+#include <semaphore.h>
+
+#ifndef YM_ASYNC_SLOTS
+#define YM_ASYNC_SLOTS      (32)
+#endif
+#define YM_ASYNC_SLOT_SIZE  (4096)
+
+typedef struct{
+	int      cmd;
+	uint32_t offset;
+	uint32_t size;
+	uint8_t  data[ YM_ASYNC_SLOT_SIZE ];
+}ym_async_slot_t;
+
+typedef struct{
+	ym_sink_t  sink;
+	ym_sink_t *target;    /* the sink doing the writes */
+	pthread_t  thread;
+	sem_t      filled;    /* slots to write */
+	sem_t      space;     /* slots to fill */
+	sem_t      drained;   /* a waiting command is done */
+	uint32_t   head;      /* next slot to write, writer thread */
+	uint32_t   tail;      /* next slot to fill, receive engine */
+	int        error;     /* a write failed, until the next open */
+	int        result;    /* of the last waiting command */
+	ym_async_slot_t slot[ YM_ASYNC_SLOTS ];
+}ym_async_sink_t;
+#endif
+
+ym_sink_t *ymodem_memSink( ym_mem_sink_t *ms, uint8_t *buffer, uint32_t capacity );
+ym_sink_t *ymodem_nullSink( ym_null_sink_t *ns );
+ym_sink_t *ymodem_fileSink( ym_file_sink_t *fs, const char *path );
+#if YM_SINK_MMAP
+ym_sink_t *ymodem_mmapSink( ym_mmap_sink_t *ms, const char *path );
+#endif
+#if YM_SINK_ASYNC
+ym_sink_t *ymodem_asyncSink( ym_async_sink_t *as, ym_sink_t *target );
+void ymodem_asyncSinkStop( ym_async_sink_t *as );
+#endif
+
+/* Receive engine parse state, ymodem_Receive may stop anywhere in a packet */
+typedef struct{
+	char    *filename;    /* where the file name goes */
+	int      filename_max;
+	int      phase;       /* YM_RX_xxx */
+	int      header_idx;  /* bytes of the packet header seen */
+	uint8_t  header[ PACKET_HEADER_SIZE ];
+	uint8_t *data;        /* payload destination */
+	int      data_size;
+	int      data_idx;
+	uint16_t crc;         /* running CRC16 of the payload */
+	uint8_t  trailer[ PACKET_CRC32_SIZE ];
+	int      trailer_idx;
+	int      in_file;     /* between a file header and its EOT */
+	int      begun;       /* a packet was received, timeouts count as errors */
+	int      errors;      /* errors in a row */
+	int      noise;       /* out of sync, EOT and CA are not trusted */
+	uint32_t file_size;   /* from the header, 0: unknown */
+	uint32_t file_pos;    /* bytes delivered */
+	int      stored[ YM_WINDOW_MAX+1 ]; /* payload size of packets received ahead, by buffer */
+}ym_rx_t;
+
+/* Non-blocking transmit state, the session moves on from the ymodem_onXxx
+ * calls only */
+typedef struct{
+	int      phase;       /* YM_TX_xxx */
+	int      tries;       /* header requests left to wait for, <0: no limit */
+	int      retry;       /* timeouts or NAKs of the current step */
+	int      answer;      /* first byte of a two byte answer, -1: none */
+	int      eof;         /* readData reached the end of the file */
+	const uint8_t *tail;  /* last block, sent in 128B-packets */
+	int      tail_size;   /* bytes of it left, padded */
+	uint64_t resend;      /* packets in flight to send again, bit 0 the oldest */
+	ym_frame_t next;      /* frame to send next */
+	int      has_next;
+	int      eot;         /* EOT to send */
+	ym_frame_t out;       /* frame being written */
+	const uint8_t *out_seg[4];
+	int      out_len[4];
+	int      out_idx;     /* piece of out being written, 4: idle */
+	int      out_pos;     /* bytes of that piece written */
+	int      out_new;     /* out is sent the first time */
+}ym_tx_t;
+
 typedef struct{
 	/* @brief Send a byte callback function.
 	 * @param ym 
@@ -93,19 +354,84 @@ typedef struct{
 	int (*putByte)( ymodem_t *ym, uint8_t bdata );
 	/* @brief Receive a byte callback function.
 	 * @param ym
-	 * @param timeout
+	 * @param timeout 0 polls without blocking
    * @ret   -1: error
 	 */
 	int (*getByte)( ymodem_t *ym, int timeout );
+	/* @brief Receive a block callback function, optional.
+	 *        Waits for size bytes, returns early only on timeout.
+	 *        Used for packets and windowed ACKs, getByte otherwise.
+	 * @param ym
+	 * @param data
+	 * @param size
+	 * @param timeout
+	 * @ret   bytes read, -1: error
+	 */
+	int (*getBlock)( ymodem_t *ym, uint8_t *data, int size, int timeout );
+	/* @brief Send a block callback function, optional.
+	 *        When set, each framed packet is sent with a single call,
+	 *        otherwise putByte is called for every byte.
+	 * @param ym
+	 * @param data The data to be send.
+	 * @param size
+	 * @ret   size: success, -1: error
+	 */
+	int (*putBlock)( ymodem_t *ym, const uint8_t *data, int size );
+	/* @brief Flush point callback, optional.
+	 *        Called after each framed packet and each answer, a line that
+	 *        coalesces writes sends what it holds then.
+	 * @param ym
+	 */
+	void (*flush)( ymodem_t *ym );
+	/* @brief File data callback for the non-blocking transmit, optional.
+	 * @param ym
+	 * @param data
+	 * @param size
+	 * @ret   bytes read, fewer than size only at the end of the file,
+	 *        -1: error
+	 */
+	int (*readData)( ymodem_t *ym, uint8_t *data, int size );
+	ym_sink_t *sink;   /* where received files go, NULL: dropped */
 	int timeout;
 	int num_of_retry;
+	int packet_policy; /* YM_POLICY_xxx */
+	int options;       /* YM_OPT_xxx */
+	int window;        /* packets in flight with YM_OPT_WINDOW, 0: YM_WINDOW_MAX */
+	int large_block;   /* largest packet offered in the header, a power of two
+	                    * from YM_PACKET_SIZE_4K to YM_PACKET_SIZE_32K, 0: none.
+	                    * A receiver takes at most YM_LARGE_MAX.
+	                    * Large packets go straight from the caller's data, which
+	                    * needs chunks of at least this size (plus one 1K block
+	                    * per packet in flight) */
 }ymodem_config_t;
 
 struct YModem{
 	ymodem_config_t config;
-	/* SOH/STX NUM ^NUM Data[1024] CRC CRC */
-	uint8_t buffer[ 1024 ];
-	int     buff_idx;
+	/* Framed packet, same layout as the packet in IAP memory:
+	 * unused | SOH/STX | NUM | ^NUM | Data[1024] | CRC | CRC
+	 * data is staged at PACKET_DATA_INDEX as a ring, so the packet is sent
+	 * in place from PACKET_START_INDEX.
+	 * packet[buff] is staging while the others may hold packets waiting
+	 * for their ACK, used in turn. A large packet is received into large,
+	 * there are no packets kept ahead then */
+	union{
+		uint8_t packet[ YM_WINDOW_MAX+1 ][ PACKET_DATA_INDEX + YM_PACKET_SIZE_1K + PACKET_TRAILER_SIZE ];
+		uint8_t large[ PACKET_DATA_INDEX + YM_LARGE_MAX ];
+	};
+	int     buff;      /* staging buffer */
+	int     buff_head; /* ring index of the first staged byte */
+	int     buff_idx;  /* bytes of data staged */
+	uint16_t crc;      /* running CRC16 of the staged data */
+	ym_pending_t pending[ YM_WINDOW_MAX ]; /* sent, ACK not seen yet, a ring */
+	int          pending_head; /* oldest one, its number is packet_idx */
+	int          has_pending;  /* how many */
+	int streaming;     /* YModem-g negotiated */
+	int windowed;      /* sliding window negotiated */
+	int large_size;    /* large packet size negotiated, 0: none */
+	int adapt_count;   /* packets since the last size change */
+	ym_stats_t stats;
+	ym_rx_t rx;
+	ym_tx_t tx;
 	int packet_idx;
 	int state;
 };
@@ -118,8 +444,35 @@ int ymodem_startTransmit( ymodem_t *ym, const char *filename, int retry_cnt );
 int ymodem_transmit( ymodem_t *ym, const uint8_t *data, int size );
 int ymodem_finishTransmit( ymodem_t *ym );
 
+/*
+ * Non-blocking transmit. ymodem_pollTransmit starts a session sending one
+ * file read with config.readData, nothing blocks after that: call
+ * ymodem_onWritable when ymodem_wantWrite and the line takes data,
+ * ymodem_onReadable when the line has data and ymodem_onTimer when
+ * ymodem_wantRead and nothing came in for config.timeout. putBlock (or
+ * putByte) may take part of a block then, and returns 0 when the line is
+ * full. Each returns YM_SUCCESS to go on, YM_DONE when the session ended
+ * and <0 on error.
+ */
+int ymodem_pollTransmit( ymodem_t *ym, const char *filename, int retry_cnt );
+int ymodem_wantWrite( ymodem_t *ym );
+int ymodem_wantRead( ymodem_t *ym );
+int ymodem_onWritable( ymodem_t *ym );
+int ymodem_onReadable( ymodem_t *ym );
+int ymodem_onTimer( ymodem_t *ym );
+
+/*
+ * Receive engine, push based: feed whatever bytes arrive to ymodem_Receive,
+ * it never reads by itself. Answers go out through putByte/putBlock.
+ * Call ymodem_receiveTimeout when nothing arrived for config.timeout.
+ * Both return YM_SUCCESS to go on, YM_DONE once the session is over
+ * or an error, the session is over then too.
+ */
 int ymodem_startReceive( ymodem_t *ym, char *filename, int maxlens );
 int ymodem_Receive( ymodem_t *ym, const uint8_t *buffer, int size );
+int ymodem_receiveTimeout( ymodem_t *ym );
+/* Blocking receive loop reading with getBlock/getByte */
+int ymodem_runReceive( ymodem_t *ym );
 
 #ifdef __cplusplus
 }
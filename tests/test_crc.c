@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ymodem.h"
+
+/*
+ * The CRC16 engines against the bit-serial UpdateCRC16 reference, on random
+ * packets of both sizes, whole, in pieces and copied. The CRC32 of large
+ * packets against its check value.
+ */
+
+#ifndef YM_CRC16_TABLE
+#define YM_CRC16_TABLE 1
+#endif
+
+#define ROUNDS 1000
+
+static int fails;
+
+static void check( const char *what, int size, uint16_t crc, uint16_t expect ){
+	if( crc != expect ){
+		printf( "%s of %d bytes: %04x, expect %04x\n", what, size, crc, expect );
+		fails ++;
+	}
+}
+
+static void checkPacket( const uint8_t *data, int size ){
+	uint8_t copy[ YM_PACKET_SIZE_1K + 64 ];
+	uint16_t expect = Cal_CRC16_Bitwise( data, size );
+	uint16_t crc;
+	int split = rand() % ( size + 1 );
+
+	check( "Cal_CRC16", size, Cal_CRC16( data, size ), expect );
+#if YM_CRC16_TABLE
+	check( "Cal_CRC16_Table", size, Cal_CRC16_Table( 0, data, size ), expect );
+#endif
+
+	crc = Cal_CRC16_Update( 0, data, split );
+	check( "Cal_CRC16_Update", size, Cal_CRC16_Update( crc, data + split, size - split ), expect );
+
+	memset( copy, 0, sizeof(copy) );
+	crc = Cal_CRC16_Copy( 0, copy, data, split );
+	crc = Cal_CRC16_Copy( crc, copy + split, data + split, size - split );
+	check( "Cal_CRC16_Copy", size, crc, expect );
+	if( memcmp( copy, data, size ) != 0 ){
+		printf( "Cal_CRC16_Copy of %d bytes: data differs\n", size );
+		fails ++;
+	}
+}
+
+int main( void ){
+	static const uint8_t check_string[] = "123456789";
+	uint8_t buffer[ YM_PACKET_SIZE_1K + 16 ];
+	int round;
+	int off;
+	int idx;
+
+	/* The XMODEM check value */
+	check( "Cal_CRC16_Bitwise", 9, Cal_CRC16_Bitwise( check_string, 9 ), 0x31C3 );
+	check( "Cal_CRC16", 9, Cal_CRC16( check_string, 9 ), 0x31C3 );
+	/* CRC-32/ISO-HDLC, in one go and in pieces */
+	if( Cal_CRC32( check_string, 9 ) != 0xCBF43926 ||
+			Cal_CRC32_Update( Cal_CRC32_Update( 0, check_string, 4 ), check_string + 4, 5 ) != 0xCBF43926 ){
+		printf( "Cal_CRC32 of 9 bytes: %08x, expect cbf43926\n", Cal_CRC32( check_string, 9 ) );
+		fails ++;
+	}
+
+	srand( 1 );
+	for( round=0; round<ROUNDS; ++round ){
+		for( idx=0; idx<(int)sizeof(buffer); ++idx ){
+			buffer[idx] = rand();
+		}
+		/* Any alignment */
+		off = rand() % 16;
+		checkPacket( buffer + off, YM_PACKET_SIZE_128 );
+		checkPacket( buffer + off, YM_PACKET_SIZE_1K );
+	}
+
+	printf( "%d failed\n", fails );
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ymodem.h"
+
+/*
+ * The non-blocking sender (ymodem_pollTransmit) against the receive engine
+ * in the same process, driven the way an event loop does: onWritable while
+ * wantWrite, onReadable when answers wait and onTimer once nothing moves.
+ * The line takes only part of a block at times and is full at others, and
+ * the answers to a chosen step can get lost.
+ */
+
+#define FILE_MAX  ( 16 * 1024 )
+#define STEP_MAX  1000000
+
+/* Answers that get lost, once each */
+#define LOSE_HEADER  (1<<0)   /* to the file header */
+#define LOSE_DATA    (1<<1)   /* to the third data packet */
+#define LOSE_EOT     (1<<2)   /* to the first EOT */
+#define LOSE_START   (1<<3)   /* the first request for the header */
+
+static ymodem_t tx;
+static ymodem_t rx;
+static ym_mem_sink_t sink;
+static uint8_t image[ FILE_MAX ];
+static uint8_t received[ FILE_MAX + YM_PACKET_SIZE_1K ];
+static char filename[64];
+static int  image_size;
+static int  image_pos;
+
+static uint8_t line[ 64 * 1024 ];     /* sender to receiver */
+static int     line_size;
+static uint8_t answers[ 1024 ];       /* receiver to sender */
+static int     answer_head;
+static int     answer_size;
+
+static int write_max;                 /* bytes the line takes per call */
+static int write_calls;
+static int lose;                      /* LOSE_xxx still to happen */
+
+/* Takes up to write_max bytes, every third call finds the line full */
+static int txPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	(void)ym;
+	if( ++write_calls % 3 == 0 ){
+		return 0;
+	}
+	if( size > write_max ){
+		size = write_max;
+	}
+	memcpy( line + line_size, data, size );
+	line_size += size;
+	return size;
+}
+
+static int txPutByte( ymodem_t *ym, uint8_t bdata ){
+	return txPutBlock( ym, &bdata, 1 ) == 1 ? 0 : -1;
+}
+
+static int txGetBlock( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	(void)ym;
+	(void)timeout;
+	if( size > answer_size - answer_head ){
+		size = answer_size - answer_head;
+	}
+	memcpy( data, answers + answer_head, size );
+	answer_head += size;
+	return size;
+}
+
+static int txGetByte( ymodem_t *ym, int timeout ){
+	uint8_t bdata;
+
+	return txGetBlock( ym, &bdata, 1, timeout ) == 1 ? bdata : -1;
+}
+
+static int txReadData( ymodem_t *ym, uint8_t *data, int size ){
+	(void)ym;
+	if( size > image_size - image_pos ){
+		size = image_size - image_pos;
+	}
+	memcpy( data, image + image_pos, size );
+	image_pos += size;
+	return size;
+}
+
+static int rxPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	(void)ym;
+	memcpy( answers + answer_size, data, size );
+	answer_size += size;
+	return size;
+}
+
+static int rxPutByte( ymodem_t *ym, uint8_t bdata ){
+	return rxPutBlock( ym, &bdata, 1 ) == 1 ? 0 : -1;
+}
+
+static int rxGetByte( ymodem_t *ym, int timeout ){
+	(void)ym;
+	(void)timeout;
+	return -1;
+}
+
+/* The answers given while this happened get lost, if it is still to */
+static void loseAnswers( int what, int mark ){
+	if( lose & what ){
+		lose &= ~what;
+		answer_size = mark;
+	}
+}
+
+/* The receiver takes what is on the line */
+static int feed( void ){
+	int in_file = rx.rx.in_file;
+	int packet_idx = rx.packet_idx;
+	int mark = answer_size;
+	int ret;
+
+	ret = ymodem_Receive( &rx, line, line_size );
+	line_size = 0;
+	if( !in_file && rx.rx.in_file ){
+		loseAnswers( LOSE_HEADER, mark );
+	}
+	if( in_file && !rx.rx.in_file ){
+		loseAnswers( LOSE_EOT, mark );
+	}
+	if( packet_idx <= 3 && rx.packet_idx > 3 ){
+		loseAnswers( LOSE_DATA, mark );
+	}
+	return ret;
+}
+
+static void start( int size, int options ){
+	memset( &tx, 0, sizeof(tx) );
+	memset( &rx, 0, sizeof(rx) );
+	line_size = 0;
+	answer_head = answer_size = 0;
+	write_calls = 0;
+	image_size = size;
+	image_pos = 0;
+
+	tx.config.putByte = txPutByte;
+	tx.config.putBlock = txPutBlock;
+	tx.config.getByte = txGetByte;
+	tx.config.getBlock = txGetBlock;
+	tx.config.readData = txReadData;
+	tx.config.timeout = 1;
+	tx.config.num_of_retry = 5;
+	tx.config.options = options;
+	rx.config.getByte = rxGetByte;
+	rx.config.putByte = rxPutByte;
+	rx.config.putBlock = rxPutBlock;
+	rx.config.sink = ymodem_memSink( &sink, received, sizeof(received) );
+	rx.config.timeout = 1;
+	rx.config.num_of_retry = 5;
+	rx.config.options = options;
+	ymodem_init( &tx );
+	ymodem_init( &rx );
+}
+
+/* Run both ends until the sessions are over */
+static void run( int *tx_ret, int *rx_ret ){
+	int step;
+	int tr;
+	int rr;
+
+	rr = ymodem_startReceive( &rx, filename, sizeof(filename) );
+	if( lose & LOSE_START ){
+		lose &= ~LOSE_START;
+		answer_size = 0;
+	}
+	tr = ymodem_pollTransmit( &tx, "image.bin", 5 );
+
+	for( step=0; step<STEP_MAX && ( tr == YM_SUCCESS || rr == YM_SUCCESS ); ++step ){
+		int moved = 0;
+
+		if( tr == YM_SUCCESS && ymodem_wantWrite( &tx ) ){
+			int before = write_calls;
+			tr = ymodem_onWritable( &tx );
+			moved = write_calls != before;
+		}
+		if( line_size > 0 ){
+			if( rr == YM_SUCCESS ){
+				rr = feed();
+			}
+			line_size = 0;
+			moved = 1;
+		}
+		if( answer_head < answer_size ){
+			if( tr == YM_SUCCESS ){
+				tr = ymodem_onReadable( &tx );
+			}
+			answer_head = answer_size = 0;
+			moved = 1;
+		}
+		if( !moved ){
+			/* Quiet line, both time out */
+			if( tr == YM_SUCCESS && ymodem_wantRead( &tx ) ){
+				tr = ymodem_onTimer( &tx );
+			}
+			if( rr == YM_SUCCESS ){
+				rr = ymodem_receiveTimeout( &rx );
+			}
+		}
+	}
+
+	*tx_ret = tr;
+	*rx_ret = rr;
+}
+
+static int check( const char *what, int size, int tr, int rr ){
+	int idx;
+
+	if( tr != YM_DONE || rr != YM_DONE ){
+		printf( "%s, %d bytes: sender %d, receiver %d\n", what, size, tr, rr );
+		return 1;
+	}
+	if( !sink.complete || (int)sink.size < size || memcmp( received, image, size ) != 0 ||
+			strcmp( filename, "image.bin" ) != 0 ){
+		printf( "%s, %d bytes: received %u bytes\n", what, size, sink.size );
+		return 1;
+	}
+	for( idx=size; idx<(int)sink.size; ++idx ){
+		if( received[idx] != 0 ){
+			printf( "%s, %d bytes: padding at %d\n", what, size, idx );
+			return 1;
+		}
+	}
+	if( lose != 0 ){
+		printf( "%s, %d bytes: answers %x not lost\n", what, size, lose );
+		return 1;
+	}
+	return 0;
+}
+
+/* Whole files with a line that takes little at a time */
+static int testWrites( void ){
+	static const int sizes[] = { 0, 1, 128, 900, 1024, 5000, FILE_MAX };
+	static const int writes[] = { 1, 7, 1029, 100000 };
+	static const int options[] = { 0, YM_OPT_WINDOW };
+	char what[64];
+	int fails = 0;
+	int opt;
+	int size;
+	int wr;
+	int tr;
+	int rr;
+
+	for( opt=0; opt<2; ++opt ){
+		for( wr=0; wr<(int)(sizeof(writes)/sizeof(writes[0])); ++wr ){
+			for( size=0; size<(int)(sizeof(sizes)/sizeof(sizes[0])); ++size ){
+				start( sizes[size], options[opt] );
+				write_max = writes[wr];
+				lose = 0;
+				run( &tr, &rr );
+				snprintf( what, sizeof(what), "Options %d, writes of %d", options[opt], writes[wr] );
+				fails += check( what, sizes[size], tr, rr );
+			}
+		}
+	}
+
+	return fails;
+}
+
+/* Lost answers: the sender's timer sends the header, the packet or the
+ * EOT again and the receiver answers the repeat */
+static int testRetries( void ){
+	static const struct{
+		int lose;
+		const char *what;
+	}cases[] = {
+		{ LOSE_START,  "Lost header request" },
+		{ LOSE_HEADER, "Lost header ACK" },
+		{ LOSE_DATA,   "Lost data ACK" },
+		{ LOSE_EOT,    "Lost EOT ACK" },
+		{ LOSE_START | LOSE_HEADER | LOSE_DATA | LOSE_EOT, "All lost" },
+	};
+	static const int options[] = { 0, YM_OPT_WINDOW };
+	char what[64];
+	int fails = 0;
+	int opt;
+	int idx;
+	int tr;
+	int rr;
+
+	for( opt=0; opt<2; ++opt ){
+		for( idx=0; idx<(int)(sizeof(cases)/sizeof(cases[0])); ++idx ){
+			start( 5000, options[opt] );
+			write_max = 100;
+			lose = cases[idx].lose;
+			run( &tr, &rr );
+			snprintf( what, sizeof(what), "%s, options %d", cases[idx].what, options[opt] );
+			fails += check( what, 5000, tr, rr );
+			if( ( cases[idx].lose & ( LOSE_HEADER | LOSE_DATA ) ) && tx.stats.resends == 0 ){
+				printf( "%s: nothing sent again\n", what );
+				fails ++;
+			}
+		}
+	}
+
+	return fails;
+}
+
+/* Nobody asks for the header: the requests to wait for run out */
+static int testNoReceiver( void ){
+	int ret;
+	int idx;
+
+	start( 1000, 0 );
+	ret = ymodem_pollTransmit( &tx, "image.bin", 3 );
+	if( ret != YM_SUCCESS || ymodem_wantWrite( &tx ) || !ymodem_wantRead( &tx ) ){
+		printf( "No receiver: %d, want write %d read %d\n", ret,
+				ymodem_wantWrite( &tx ), ymodem_wantRead( &tx ) );
+		return 1;
+	}
+	for( idx=0; idx<3 && ret == YM_SUCCESS; ++idx ){
+		ret = ymodem_onTimer( &tx );
+	}
+	if( idx != 3 || ret != YM_ERROR_TIMEOUT || ymodem_wantRead( &tx ) ){
+		printf( "No receiver: %d after %d timeouts\n", ret, idx );
+		return 1;
+	}
+	return 0;
+}
+
+int main( void ){
+	int fails;
+	int idx;
+
+	srand( 1 );
+	for( idx=0; idx<FILE_MAX; ++idx ){
+		image[idx] = rand();
+	}
+
+	fails = testWrites();
+	fails += testRetries();
+	fails += testNoReceiver();
+
+	printf( "%d failed\n", fails );
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ymodem.h"
+
+/*
+ * The push receive engine fed with hand made byte streams: line noise,
+ * corrupted and repeated packets, packets ahead in windowed mode, a remote
+ * abort and timeouts. Every stream is fed whole and split in small pieces,
+ * the answers and the file received must not depend on that.
+ */
+
+#define FILE_SIZE  300   /* three 128B-packets, the last one padded */
+
+static ymodem_t rx;
+static ym_mem_sink_t sink;
+static uint8_t image[ 4 * YM_PACKET_SIZE_128 ];
+static uint8_t received[ 4 * YM_PACKET_SIZE_1K ];
+static char filename[64];
+
+static uint8_t stream[ 8 * 1024 ];    /* what the sender puts */
+static int     stream_size;
+static uint8_t answers[ 256 ];        /* what the receiver puts */
+static int     answer_size;
+static int     split;                 /* bytes fed at a time, 0: all */
+
+static int rxPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	(void)ym;
+	memcpy( answers + answer_size, data, size );
+	answer_size += size;
+	return size;
+}
+
+static int rxPutByte( ymodem_t *ym, uint8_t bdata ){
+	return rxPutBlock( ym, &bdata, 1 ) == 1 ? 0 : -1;
+}
+
+static int rxGetByte( ymodem_t *ym, int timeout ){
+	(void)ym;
+	(void)timeout;
+	return -1;
+}
+
+static void put( const uint8_t *data, int size ){
+	memcpy( stream + stream_size, data, size );
+	stream_size += size;
+}
+
+static void putByte( uint8_t bdata ){
+	put( &bdata, 1 );
+}
+
+/* A 128B-packet, corrupted: one data bit flipped */
+static void putPacket( uint8_t seq, const uint8_t *data, int corrupted ){
+	uint8_t packet[ PACKET_HEADER_SIZE + YM_PACKET_SIZE_128 + PACKET_TRAILER_SIZE ];
+	uint16_t crc = Cal_CRC16( data, YM_PACKET_SIZE_128 );
+
+	packet[0] = SOH;
+	packet[1] = seq;
+	packet[2] = ~seq;
+	memcpy( packet + PACKET_HEADER_SIZE, data, YM_PACKET_SIZE_128 );
+	packet[ PACKET_HEADER_SIZE + YM_PACKET_SIZE_128 ] = crc >> 8;
+	packet[ PACKET_HEADER_SIZE + YM_PACKET_SIZE_128 + 1 ] = crc & 0xFF;
+	if( corrupted ){
+		packet[ PACKET_HEADER_SIZE + 5 ] ^= 0x10;
+	}
+	put( packet, sizeof(packet) );
+}
+
+/* Data packet 1..3 of the image */
+static void putData( uint8_t seq ){
+	putPacket( seq, image + ( seq - 1 ) * YM_PACKET_SIZE_128, 0 );
+}
+
+/* File header, or the empty one ending the session */
+static void putHeader( int empty ){
+	uint8_t data[ YM_PACKET_SIZE_128 ];
+
+	memset( data, 0, sizeof(data) );
+	if( !empty ){
+		snprintf( (char *)data, sizeof(data), "image.bin%c%d", 0, FILE_SIZE );
+	}
+	putPacket( 0, data, 0 );
+}
+
+static void start( int options ){
+	memset( &rx, 0, sizeof(rx) );
+	stream_size = 0;
+	answer_size = 0;
+
+	rx.config.getByte = rxGetByte;
+	rx.config.putByte = rxPutByte;
+	rx.config.putBlock = rxPutBlock;
+	rx.config.sink = ymodem_memSink( &sink, received, sizeof(received) );
+	rx.config.timeout = 1;
+	rx.config.num_of_retry = 3;
+	rx.config.options = options;
+	ymodem_init( &rx );
+	ymodem_startReceive( &rx, filename, sizeof(filename) );
+}
+
+/* Feed the stream so far, split bytes at a time. Returns the first result
+ * other than YM_SUCCESS */
+static int feed( void ){
+	int ret = YM_SUCCESS;
+	int idx;
+	int size;
+
+	for( idx=0; idx<stream_size && ret == YM_SUCCESS; idx+=size ){
+		size = split > 0 && split < stream_size - idx ? split : stream_size - idx;
+		ret = ymodem_Receive( &rx, stream + idx, size );
+	}
+	stream_size = 0;
+	return ret;
+}
+
+static int check( const char *what, int ret, int expect_ret, const uint8_t *expect, int expect_size ){
+	int idx;
+
+	if( ret != expect_ret ){
+		printf( "%s, split %d: returned %d, expect %d\n", what, split, ret, expect_ret );
+		return 1;
+	}
+	if( answer_size != expect_size || memcmp( answers, expect, expect_size ) != 0 ){
+		printf( "%s, split %d: answers", what, split );
+		for( idx=0; idx<answer_size; ++idx ){
+			printf( " %02x", answers[idx] );
+		}
+		printf( ", expect" );
+		for( idx=0; idx<expect_size; ++idx ){
+			printf( " %02x", expect[idx] );
+		}
+		printf( "\n" );
+		return 1;
+	}
+	return 0;
+}
+
+/* The whole file arrived once, in order */
+static int checkFile( const char *what ){
+	if( !sink.complete || sink.size != FILE_SIZE || memcmp( received, image, FILE_SIZE ) != 0 ||
+			strcmp( filename, "image.bin" ) != 0 ){
+		printf( "%s, split %d: received %u bytes, complete %d, name %s\n",
+				what, split, sink.size, sink.complete, filename );
+		return 1;
+	}
+	return 0;
+}
+
+/* Noise before and between packets and a corrupted packet: the engine
+ * finds the packets again, NAKs the bad one and takes it when repeated */
+static int testNoise( void ){
+	static const uint8_t noise[] = { 0x55, 0xAA, SOH, 0x05, 0x05, STX, 0x00, 0x00, 0xFF, EOT, CA };
+	static const uint8_t expect[] = { CRC16, ACK, CRC16, ACK, NAK, ACK, ACK, ACK, CRC16, ACK };
+	int ret;
+
+	start( 0 );
+	put( noise, sizeof(noise) );
+	putHeader( 0 );
+	put( noise, sizeof(noise) );
+	putData( 1 );
+	putPacket( 2, image + YM_PACKET_SIZE_128, 1 );
+	put( noise, 4 );
+	putData( 2 );
+	putData( 3 );
+	putByte( EOT );
+	putHeader( 1 );
+	ret = feed();
+
+	return check( "Noise", ret, YM_DONE, expect, sizeof(expect) ) + checkFile( "Noise" );
+}
+
+/* The ACK got lost, the sender repeats: ACK again, keep the data once */
+static int testRepeat( void ){
+	static const uint8_t expect[] = { CRC16, ACK, CRC16, ACK, CRC16, ACK, ACK, ACK, ACK, ACK, CRC16, ACK, CRC16, ACK };
+	int ret;
+
+	start( 0 );
+	putHeader( 0 );
+	putHeader( 0 );
+	putData( 1 );
+	putData( 1 );
+	putData( 2 );
+	putData( 3 );
+	putByte( EOT );
+	putByte( EOT );
+	putHeader( 1 );
+	ret = feed();
+
+	return check( "Repeat", ret, YM_DONE, expect, sizeof(expect) ) + checkFile( "Repeat" );
+}
+
+/* Windowed: a packet ahead of a lost one is kept, a bad one NAKed with its
+ * number, any packet of the window behind answered again */
+static int testWindow( void ){
+	static const uint8_t expect[] = {
+		YMODEM_W, ACK, 0, YMODEM_W,
+		ACK, 2,        /* ahead of 1, kept */
+		NAK, 3,        /* bad */
+		ACK, 1,        /* 1 and 2 go to the file */
+		ACK, 1,        /* 1 again, two behind */
+		ACK, 3,
+		ACK, 2,        /* 2 again */
+		ACK, YMODEM_W, ACK, 0 };
+	int ret;
+
+	start( YM_OPT_WINDOW );
+	putHeader( 0 );
+	putData( 2 );
+	putPacket( 3, image + 2 * YM_PACKET_SIZE_128, 1 );
+	putData( 1 );
+	putData( 1 );
+	putData( 3 );
+	putData( 2 );
+	putByte( EOT );
+	putHeader( 1 );
+	ret = feed();
+
+	return check( "Window", ret, YM_DONE, expect, sizeof(expect) ) + checkFile( "Window" );
+}
+
+/* CA CA from the sender ends the session, the file is dropped */
+static int testAbort( void ){
+	static const uint8_t expect[] = { CRC16, ACK, CRC16, ACK };
+	int ret;
+
+	start( 0 );
+	putHeader( 0 );
+	putData( 1 );
+	putByte( CA );
+	putByte( CA );
+	ret = feed();
+
+	if( check( "Abort", ret, YM_ERROR_ABORT, expect, sizeof(expect) ) ){
+		return 1;
+	}
+	if( sink.complete ){
+		printf( "Abort, split %d: file completed\n", split );
+		return 1;
+	}
+	return 0;
+}
+
+/* Timeouts: ask for the header again, NAK inside a file dropping a partial
+ * packet, give up with CA CA after num_of_retry in a row */
+static int testTimeout( void ){
+	static const uint8_t expect[] = { CRC16, CRC16, ACK, CRC16, NAK, ACK, NAK, NAK, NAK, CA, CA };
+	uint32_t kept = 0;
+	int ret;
+	int idx;
+
+	start( 0 );
+	ret = ymodem_receiveTimeout( &rx );
+	putHeader( 0 );
+	if( ret == YM_SUCCESS ){
+		ret = feed();
+	}
+	/* Half a packet, then nothing */
+	putData( 1 );
+	stream_size /= 2;
+	if( ret == YM_SUCCESS ){
+		ret = feed();
+	}
+	if( ret == YM_SUCCESS ){
+		ret = ymodem_receiveTimeout( &rx );
+	}
+	putData( 1 );
+	if( ret == YM_SUCCESS ){
+		ret = feed();
+	}
+	kept = sink.size;
+	for( idx=0; idx<=rx.config.num_of_retry && ret == YM_SUCCESS; ++idx ){
+		ret = ymodem_receiveTimeout( &rx );
+	}
+
+	if( check( "Timeout", ret, YM_ERROR_TIMEOUT, expect, sizeof(expect) ) ){
+		return 1;
+	}
+	/* Packet 1 made it, the file is dropped on giving up */
+	if( kept != YM_PACKET_SIZE_128 || sink.complete || sink.size != 0 ){
+		printf( "Timeout, split %d: received %u bytes, %u left\n", split, kept, sink.size );
+		return 1;
+	}
+	return 0;
+}
+
+/* A sender that doesn't know 'W' leaves it unanswered: the next request is
+ * 'C' and the session stays plain */
+static int testFallback( void ){
+	static const uint8_t expect[] = { YMODEM_W, CRC16, ACK, CRC16, ACK, ACK, ACK, ACK, CRC16, ACK };
+	int ret;
+
+	start( YM_OPT_WINDOW );
+	ret = ymodem_receiveTimeout( &rx );
+	putHeader( 0 );
+	putData( 1 );
+	putData( 2 );
+	putData( 3 );
+	putByte( EOT );
+	putHeader( 1 );
+	if( ret == YM_SUCCESS ){
+		ret = feed();
+	}
+
+	return check( "Fallback", ret, YM_DONE, expect, sizeof(expect) ) + checkFile( "Fallback" );
+}
+
+int main( void ){
+	static const int splits[] = { 0, 1, 3, 131 };
+	int fails = 0;
+	int idx;
+
+	srand( 1 );
+	for( idx=0; idx<(int)sizeof(image); ++idx ){
+		image[idx] = idx < FILE_SIZE ? rand() : 0;
+	}
+
+	for( idx=0; idx<(int)(sizeof(splits)/sizeof(splits[0])); ++idx ){
+		split = splits[idx];
+		fails += testNoise();
+		fails += testRepeat();
+		fails += testWindow();
+		fails += testAbort();
+		fails += testTimeout();
+		fails += testFallback();
+	}
+
+	printf( "%d failed\n", fails );
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ymodem.h"
+
+/*
+ * The packets ymodem_transmit and ymodem_finishTransmit put on the line,
+ * kept by the sender's putBlock and counted. The receive engine runs in the
+ * same process and answers, it gets what the sender puts right away.
+ */
+
+#define FILE_MAX  ( 16 * 1024 )
+
+static ymodem_t tx;
+static ymodem_t rx;
+static ym_mem_sink_t sink;
+static uint8_t image[ FILE_MAX ];
+static uint8_t received[ FILE_MAX + YM_PACKET_SIZE_1K ];
+static char filename[64];
+
+static uint8_t line[ 64 * 1024 ];     /* sender to receiver */
+static int     line_size;
+static uint8_t answers[ 1024 ];       /* receiver to sender */
+static int     answer_head;
+static int     answer_size;
+
+static uint8_t sent[ 64 * 1024 ];     /* everything the sender put */
+static int     sent_size;
+static int     count_soh;
+static int     count_stx;
+static int     count_large;
+static int     count_bytes;           /* of the data packets */
+static int     large_size;            /* agreed in the header exchange */
+static int     write_max;             /* bytes putBlock takes per call, 0: all */
+static int     write_left;            /* bytes before the line fails, <0: no end */
+
+/* Data packets sent, the headers are packet 0 and the files here are
+ * too short for the packet number to wrap */
+static void count( void ){
+	int size;
+	int idx;
+
+	count_soh = count_stx = count_large = count_bytes = 0;
+	for( idx=0; idx<sent_size; idx+=size ){
+		if( sent[idx] == STX_LARGE && large_size > 0 ){
+			size = PACKET_HEADER_SIZE + large_size + PACKET_CRC32_SIZE;
+		}
+		else if( sent[idx] == SOH || sent[idx] == STX ){
+			size = PACKET_HEADER_SIZE + PACKET_TRAILER_SIZE +
+					( sent[idx] == SOH ? YM_PACKET_SIZE_128 : YM_PACKET_SIZE_1K );
+		}
+		else{
+			size = 1;
+			continue;
+		}
+		if( idx + 1 < sent_size && sent[idx+1] != 0 ){
+			count_soh += sent[idx] == SOH;
+			count_stx += sent[idx] == STX;
+			count_large += sent[idx] == STX_LARGE;
+			count_bytes += size;
+		}
+	}
+}
+
+static int txPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	(void)ym;
+	if( write_max > 0 && size > write_max ){
+		size = write_max;
+	}
+	if( write_left >= 0 ){
+		if( size > write_left ){
+			size = write_left;
+		}
+		write_left -= size;
+	}
+	memcpy( sent + sent_size, data, size );
+	sent_size += size;
+	memcpy( line + line_size, data, size );
+	line_size += size;
+	return size;
+}
+
+static int txPutByte( ymodem_t *ym, uint8_t bdata ){
+	return txPutBlock( ym, &bdata, 1 ) == 1 ? 0 : -1;
+}
+
+static int rxPutBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	(void)ym;
+	memcpy( answers + answer_size, data, size );
+	answer_size += size;
+	return size;
+}
+
+static int rxPutByte( ymodem_t *ym, uint8_t bdata ){
+	return rxPutBlock( ym, &bdata, 1 ) == 1 ? 0 : -1;
+}
+
+/* The receiver takes what is on the line, the sender gets its answers */
+static int txGetByte( ymodem_t *ym, int timeout ){
+	(void)ym;
+	(void)timeout;
+
+	if( line_size > 0 ){
+		ymodem_Receive( &rx, line, line_size );
+		line_size = 0;
+	}
+	if( answer_head == answer_size ){
+		return -1;
+	}
+	return answers[ answer_head++ ];
+}
+
+/* The push receiver never reads */
+static int rxGetByte( ymodem_t *ym, int timeout ){
+	(void)ym;
+	(void)timeout;
+	return -1;
+}
+
+/* The sender offers large packets up to offer bytes, the receiver takes
+ * up to accept, 0: none */
+static void start( int policy, int offer, int accept ){
+	memset( &tx, 0, sizeof(tx) );
+	memset( &rx, 0, sizeof(rx) );
+	line_size = 0;
+	sent_size = 0;
+	answer_head = answer_size = 0;
+	write_max = 0;
+	write_left = -1;
+
+	tx.config.putByte = txPutByte;
+	tx.config.putBlock = txPutBlock;
+	tx.config.getByte = txGetByte;
+	tx.config.timeout = 1;
+	tx.config.num_of_retry = 3;
+	tx.config.packet_policy = policy;
+	tx.config.large_block = offer;
+	rx.config.getByte = rxGetByte;
+	rx.config.putByte = rxPutByte;
+	rx.config.putBlock = rxPutBlock;
+	rx.config.sink = ymodem_memSink( &sink, received, sizeof(received) );
+	rx.config.timeout = 1;
+	rx.config.num_of_retry = 3;
+	rx.config.large_block = accept;
+	ymodem_init( &tx );
+	ymodem_init( &rx );
+
+	ymodem_startReceive( &rx, filename, sizeof(filename) );
+	ymodem_startTransmit( &tx, "image.bin", 3 );
+	large_size = tx.large_size;
+}
+
+/* Data packets and their bytes on the line match, the receiver has the
+ * file followed by the padding. large packets are of the size agreed */
+static int check( const char *what, int size, int soh, int stx, int large ){
+	int packets = soh * ( PACKET_HEADER_SIZE + YM_PACKET_SIZE_128 + PACKET_TRAILER_SIZE ) +
+			stx * ( PACKET_HEADER_SIZE + YM_PACKET_SIZE_1K + PACKET_TRAILER_SIZE ) +
+			large * ( PACKET_HEADER_SIZE + large_size + PACKET_CRC32_SIZE );
+	int padded = soh * YM_PACKET_SIZE_128 + stx * YM_PACKET_SIZE_1K + large * large_size;
+	int idx;
+
+	count();
+	if( count_soh != soh || count_stx != stx || count_large != large || count_bytes != packets ){
+		printf( "%s, %d bytes: %d SOH %d STX %d large %d bytes, expect %d SOH %d STX %d large %d bytes\n",
+				what, size, count_soh, count_stx, count_large, count_bytes, soh, stx, large, packets );
+		return 1;
+	}
+	if( !sink.complete || (int)sink.size != padded || memcmp( received, image, size ) != 0 ){
+		printf( "%s, %d bytes: received %u bytes\n", what, size, sink.size );
+		return 1;
+	}
+	for( idx=size; idx<padded; ++idx ){
+		if( received[idx] != 0 ){
+			printf( "%s, %d bytes: padding at %d\n", what, size, idx );
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Send the file in chunks of the given size */
+static void sendChunks( int size, int chunk ){
+	int off;
+
+	for( off=0; off<size; off+=chunk ){
+		ymodem_transmit( &tx, image + off, size - off < chunk ? size - off : chunk );
+	}
+	ymodem_finishTransmit( &tx );
+}
+
+/* With 1K-packets only the chunk size doesn't matter: full 1K-packets and
+ * the tail of 784 bytes in seven 128B-packets */
+static int testChunks( void ){
+	static const int chunks[] = { 1, 127, 1023, 1025, 4096 };
+	char what[64];
+	int fails = 0;
+	int idx;
+
+	for( idx=0; idx<(int)(sizeof(chunks)/sizeof(chunks[0])); ++idx ){
+		start( YM_POLICY_1K, 0, 0 );
+		sendChunks( 10000, chunks[idx] );
+		snprintf( what, sizeof(what), "1K policy, chunks of %d", chunks[idx] );
+		fails += check( what, 10000, 7, 9, 0 );
+	}
+
+	/* Eager: a 128B-packet once 128 bytes are staged */
+	start( YM_POLICY_EAGER, 0, 0 );
+	sendChunks( 10000, 1 );
+	fails += check( "Eager policy, chunks of 1", 10000, 79, 0, 0 );
+
+	return fails;
+}
+
+/*
+ * The tail left for ymodem_finishTransmit, sent in one ymodem_transmit call.
+ * A 1K-packet costs as much as seven 128B-packets with YM_TURNAROUND_BYTES
+ * at 16, eight of them are dearer. A whole 1K block goes out right away.
+ * Eager sends one 128B-packet from ymodem_transmit, the rest is the tail.
+ */
+static const struct{
+	int policy;
+	int first;
+	int last;
+	int soh;
+	int stx;
+}tails[] = {
+	{ YM_POLICY_1K,    0,    0,    0, 0 },
+	{ YM_POLICY_1K,    1,    128,  1, 0 },
+	{ YM_POLICY_1K,    129,  256,  2, 0 },
+	{ YM_POLICY_1K,    257,  384,  3, 0 },
+	{ YM_POLICY_1K,    385,  512,  4, 0 },
+	{ YM_POLICY_1K,    513,  640,  5, 0 },
+	{ YM_POLICY_1K,    641,  768,  6, 0 },
+	{ YM_POLICY_1K,    769,  896,  7, 0 },
+	{ YM_POLICY_1K,    897,  1024, 0, 1 },
+	{ YM_POLICY_EAGER, 0,    0,    0, 0 },
+	{ YM_POLICY_EAGER, 1,    128,  1, 0 },
+	{ YM_POLICY_EAGER, 129,  256,  2, 0 },
+	{ YM_POLICY_EAGER, 257,  384,  3, 0 },
+	{ YM_POLICY_EAGER, 385,  512,  4, 0 },
+	{ YM_POLICY_EAGER, 513,  640,  5, 0 },
+	{ YM_POLICY_EAGER, 641,  768,  6, 0 },
+	{ YM_POLICY_EAGER, 769,  896,  7, 0 },
+	{ YM_POLICY_EAGER, 897,  1023, 8, 0 },
+	{ YM_POLICY_EAGER, 1024, 1024, 0, 1 },
+};
+
+static int testTails( void ){
+	char what[64];
+	int fails = 0;
+	int size;
+	int idx;
+
+	for( idx=0; idx<(int)(sizeof(tails)/sizeof(tails[0])); ++idx ){
+		for( size=tails[idx].first; size<=tails[idx].last; ++size ){
+			start( tails[idx].policy, 0, 0 );
+			sendChunks( size, size > 0 ? size : 1 );
+			snprintf( what, sizeof(what), "%s policy, tail",
+					tails[idx].policy == YM_POLICY_EAGER ? "Eager" : "1K" );
+			fails += check( what, size, tails[idx].soh, tails[idx].stx, 0 );
+		}
+	}
+
+	return fails;
+}
+
+/*
+ * Large packets offered in the header. A receiver taking them answers 'L'
+ * and the size, capped at YM_LARGE_MAX (4K): whole large blocks of the
+ * caller's data go out as STX_LARGE with a CRC32, the rest as usual. One
+ * that doesn't gets the same file in 1K-packets, as if nothing was offered.
+ */
+static int testLarge( void ){
+	int fails = 0;
+
+	start( YM_POLICY_1K, YM_PACKET_SIZE_32K, YM_PACKET_SIZE_32K );
+	if( tx.large_size != YM_LARGE_MAX || rx.large_size != YM_LARGE_MAX ){
+		printf( "Large accepted: sender %d receiver %d bytes, expect %d\n",
+				tx.large_size, rx.large_size, YM_LARGE_MAX );
+		fails ++;
+	}
+	sendChunks( 10000, 10000 );
+	fails += check( "Large accepted", 10000, 7, 1, 2 );
+
+	start( YM_POLICY_1K, YM_PACKET_SIZE_32K, 0 );
+	if( tx.large_size != 0 || rx.large_size != 0 ){
+		printf( "Large declined: sender %d receiver %d bytes\n", tx.large_size, rx.large_size );
+		fails ++;
+	}
+	sendChunks( 10000, 10000 );
+	fails += check( "Large declined", 10000, 7, 9, 0 );
+
+	return fails;
+}
+
+/* Short writes go on with the rest, a line that takes nothing more ends
+ * the transmit */
+static int testWrites( void ){
+	int fails = 0;
+	int ret;
+
+	start( YM_POLICY_1K, 0, 0 );
+	write_max = 100;
+	sendChunks( 10000, 4096 );
+	fails += check( "Short writes", 10000, 7, 9, 0 );
+
+	start( YM_POLICY_1K, 0, 0 );
+	write_left = 3000;
+	ret = ymodem_transmit( &tx, image, 10000 );
+	if( ret != YM_ERROR_COMM || tx.state != YM_STATE_READY ||
+			ymodem_finishTransmit( &tx ) != YM_ERROR_STATE ){
+		printf( "Dead line: returned %d, state %d\n", ret, tx.state );
+		fails ++;
+	}
+
+	return fails;
+}
+
+int main( void ){
+	int fails;
+	int idx;
+
+	srand( 1 );
+	for( idx=0; idx<FILE_MAX; ++idx ){
+		image[idx] = rand();
+	}
+
+	fails = testChunks();
+	fails += testTails();
+	fails += testLarge();
+	fails += testWrites();
+
+	printf( "%d failed\n", fails );
+	return fails ? 1 : 0;
+}
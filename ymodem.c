@@ -12,51 +12,18 @@
 #define YM_PDEBUG( fmt, args... ) printf( "[D] %s %d:" fmt, __FUNCTION__, __LINE__, ##args )
 #define YM_PERROR( fmt, args... ) printf( "[E] %s %d:" fmt, __FUNCTION__, __LINE__, ##args )
 
-/**
- * @brief  Update CRC16 for input byte
- * @param  crc_in input value 
- * @param  input byte
- * @retval None
- */
-uint16_t UpdateCRC16(uint16_t crc_in, uint8_t byte)
-{
-	uint32_t crc = crc_in;
-	uint32_t in = byte | 0x100;
-
-	do
-	{
-		crc <<= 1;
-		in <<= 1;
-		if(in & 0x100)
-			++crc;
-		if(crc & 0x10000)
-			crc ^= 0x1021;
-	}
-
-	while(!(in & 0x10000));
-
-	return crc & 0xffffu;
-}
-
-/**
- * @brief  Cal CRC16 for YModem Packet
- * @param  data
- * @param  length
- * @retval None
- */
-uint16_t Cal_CRC16(const uint8_t* p_data, uint32_t size)
-{
-	uint32_t crc = 0;
-	const uint8_t* dataEnd = p_data+size;
+/* ACK round trip in byte times, weighs packet count against padding */
+#ifndef YM_TURNAROUND_BYTES
+#define YM_TURNAROUND_BYTES  16
+#endif
 
-	while(p_data < dataEnd)
-		crc = UpdateCRC16(crc, *p_data++);
+/* Packets sent between two changes of the adaptive packet size */
+#ifndef YM_ADAPT_HOLD
+#define YM_ADAPT_HOLD        16
+#endif
 
-	crc = UpdateCRC16(crc, 0);
-	crc = UpdateCRC16(crc, 0);
-
-	return crc&0xffffu;
-}
+/* Payload area of the staging packet buffer */
+#define YM_DATA( ym ) ( (ym)->packet[(ym)->buff] + PACKET_DATA_INDEX )
 
 static int strLen( const char *str ){
 	int len = 0;
@@ -81,34 +48,264 @@ static void arraySet( uint8_t *mem, uint8_t data, int len ){
 	}
 }
 
-static int sendPacket( ymodem_t *ym, int packet_size ){
+/* Send a block with putBlock, byte by byte if it is not provided. A short
+ * write goes on with the rest as long as the line takes something
+ * @ret YM_SUCCESS, YM_ERROR_COMM when the line fails or takes nothing */
+static int putBlock( ymodem_t *ym, const uint8_t *data, int size ){
+	int count;
+	int idx;
+
+	if( ym->config.putBlock != NULL ){
+		while( size > 0 ){
+			count = ym->config.putBlock( ym, data, size );
+			if( count <= 0 || count > size ){
+				YM_PERROR( "Write error %d, %d bytes left\n", count, size );
+				return YM_ERROR_COMM;
+			}
+			data += count;
+			size -= count;
+		}
+		return YM_SUCCESS;
+	}
+
+	for( idx=0; idx<size; ++idx ){
+		if( ym->config.putByte( ym, data[idx] ) < 0 ){
+			YM_PERROR( "Write error, %d bytes left\n", size - idx );
+			return YM_ERROR_COMM;
+		}
+	}
+	return YM_SUCCESS;
+}
+
+/* Flush point: a line coalescing writes sends what it holds */
+static void putFlush( ymodem_t *ym ){
+	if( ym->config.flush != NULL ){
+		ym->config.flush( ym );
+	}
+}
+
+/* Read size bytes with getBlock, byte by byte if it is not provided
+ * @ret Bytes read, fewer on timeout */
+static int getBytes( ymodem_t *ym, uint8_t *data, int size, int timeout ){
+	int bdata;
+	int idx;
+
+	if( ym->config.getBlock != NULL ){
+		idx = ym->config.getBlock( ym, data, size, timeout );
+		return idx > 0 ? idx : 0;
+	}
+
+	for( idx=0; idx<size; ++idx ){
+		bdata = ym->config.getByte( ym, timeout );
+		if( bdata < 0 ){
+			break;
+		}
+		data[idx] = bdata;
+	}
+	return idx;
+}
+
+static void clearPending( ymodem_t *ym ){
+	ym->pending_head = 0;
+	ym->has_pending = 0;
+}
+
+/* The line failed under the sender, the session is over and what is staged
+ * dropped. Nothing is sent, a CA would go the same way */
+static int transmitAbort( ymodem_t *ym ){
+	YM_PERROR( "Transmit aborted\n" );
+	clearPending( ym );
+	ym->buff_idx = 0;
+	ym->buff_head = 0;
+	ym->crc = 0;
+	ym->state = YM_STATE_READY;
+	return YM_ERROR_COMM;
+}
+
+/* Put a frame on the line, a failed write aborts the transmit
+ * @ret YM_SUCCESS or YM_ERROR_COMM */
+static int putFrame( ymodem_t *ym, const ym_frame_t *frame ){
+	int ret;
+
+	if( frame->frame != NULL ){
+		ret = putBlock( ym, frame->frame, PACKET_HEADER_SIZE+frame->seg_len[0]+frame->trailer_len );
+	}
+	else{
+		ret = putBlock( ym, frame->header, PACKET_HEADER_SIZE );
+		if( ret == YM_SUCCESS ){
+			ret = putBlock( ym, frame->seg[0], frame->seg_len[0] );
+		}
+		if( ret == YM_SUCCESS ){
+			ret = putBlock( ym, frame->seg[1], frame->seg_len[1] );
+		}
+		if( ret == YM_SUCCESS ){
+			ret = putBlock( ym, frame->trailer, frame->trailer_len );
+		}
+	}
+	if( ret != YM_SUCCESS ){
+		return transmitAbort( ym );
+	}
+	putFlush( ym );
+	return YM_SUCCESS;
+}
+
+/*
+ * The data area of the staging packet buffer is a ring: buff_idx bytes are staged from
+ * buff_head on, and acknowledged data is never moved. Packets are framed in
+ * place when they do not wrap, the ring goes back to the start of the packet
+ * buffer whenever it runs empty.
+ */
+static int ringSpan( int off, int size ){
+	int part = YM_PACKET_SIZE_1K - off;
+	return part < size ? part : size;
+}
+
+/* Append data at the ring tail, the running CRC follows the copy */
+static void stageData( ymodem_t *ym, const uint8_t *data, int size ){
+	int tail = ( ym->buff_head + ym->buff_idx ) % YM_PACKET_SIZE_1K;
+	int part = ringSpan( tail, size );
+
+	ym->crc = Cal_CRC16_Copy( ym->crc, YM_DATA( ym )+tail, data, part );
+	ym->crc = Cal_CRC16_Copy( ym->crc, YM_DATA( ym ), data+part, size-part );
+	ym->buff_idx += size;
+}
+
+/* Append zero padding at the ring tail */
+static void padData( ymodem_t *ym, int size ){
+	int tail = ( ym->buff_head + ym->buff_idx ) % YM_PACKET_SIZE_1K;
+	int part = ringSpan( tail, size );
+
+	arraySet( YM_DATA( ym )+tail, 0, part );
+	arraySet( YM_DATA( ym ), 0, size-part );
+	ym->crc = Cal_CRC16_Update( ym->crc, YM_DATA( ym )+tail, part );
+	ym->crc = Cal_CRC16_Update( ym->crc, YM_DATA( ym ), size-part );
+	ym->buff_idx += size;
+}
+
+/* CRC of the first size staged bytes */
+static uint16_t stagedCRC( ymodem_t *ym, int size ){
+	int part = ringSpan( ym->buff_head, size );
 	uint16_t crc;
-	int retry_cnt;
 
-	YM_ASSERT( packet_size==YM_PACKET_SIZE_128 || packet_size==YM_PACKET_SIZE_1K );
+	crc = Cal_CRC16_Update( 0, YM_DATA( ym )+ym->buff_head, part );
+	return Cal_CRC16_Update( crc, YM_DATA( ym ), size-part );
+}
 
-	crc = Cal_CRC16( ym->buffer, packet_size );
-	retry_cnt = 0;
+/* crc is the CRC16 of the payload, or its CRC32 for a large packet */
+static void initFrame( ym_frame_t *frame, uint8_t packet_idx,
+		const uint8_t *seg0, int len0, const uint8_t *seg1, int len1, uint32_t crc ){
+	int size = len0 + len1;
 
-	while( retry_cnt < ym->config.num_of_retry ){
-		retry_cnt = 0;
+	frame->frame = NULL;
+	frame->header[0] = size==YM_PACKET_SIZE_128 ? SOH : size==YM_PACKET_SIZE_1K ? STX : STX_LARGE;
+	frame->header[1] = packet_idx;
+	frame->header[2] = ~packet_idx;
+	frame->seg[0] = seg0;
+	frame->seg_len[0] = len0;
+	frame->seg[1] = seg1;
+	frame->seg_len[1] = len1;
+	if( frame->header[0] == STX_LARGE ){
+		frame->trailer[0] = crc>>24;
+		frame->trailer[1] = (crc>>16)&0xFF;
+		frame->trailer[2] = (crc>>8)&0xFF;
+		frame->trailer[3] = crc&0xFF;
+		frame->trailer_len = PACKET_CRC32_SIZE;
+	}
+	else{
+		frame->trailer[0] = crc>>8;
+		frame->trailer[1] = crc&0xFF;
+		frame->trailer_len = PACKET_TRAILER_SIZE;
+	}
+}
+
+/*
+ * Wire time per 1K of payload for packets of this size, when a packet of
+ * that size fails with error rate err (YM_ERROR_RATE_ONE is 1). Counts the
+ * header, CRC and the ACK round trip, and the packets sent again.
+ */
+static uint32_t sizeCost( int size, uint32_t err ){
+	int overhead = PACKET_HEADER_SIZE + YM_TURNAROUND_BYTES +
+			( size > YM_PACKET_SIZE_1K ? PACKET_CRC32_SIZE : PACKET_TRAILER_SIZE );
+
+	if( err >= YM_ERROR_RATE_ONE ){
+		return UINT32_MAX;
+	}
+	return (uint64_t)( size + overhead ) * YM_PACKET_SIZE_1K * YM_ERROR_RATE_ONE /
+			( (uint64_t)size * ( YM_ERROR_RATE_ONE - err ) );
+}
+
+/* Error rate seen at size from, scaled to size to. Errors are taken as
+ * spread over the bytes, so a packet fails in proportion to its size */
+static uint32_t scaleErrorRate( uint32_t err, int from, int to ){
+	uint64_t scaled = (uint64_t)err * to / from;
+
+	return scaled < YM_ERROR_RATE_ONE ? scaled : YM_ERROR_RATE_ONE;
+}
+
+/*
+ * Count one answer to a sent packet, failed on NAK or timeout.
+ * error_rate follows the recent share of failed sends. With
+ * YM_OPT_ADAPTIVE the packet size with the lowest wire time for that rate
+ * is chosen among 128B, 1K and the negotiated large size, at most every
+ * YM_ADAPT_HOLD packets.
+ */
+static void countAnswer( ymodem_t *ym, int failed ){
+	static const int sizes[] = { YM_PACKET_SIZE_128, YM_PACKET_SIZE_1K };
+	ym_stats_t *stats = &ym->stats;
+	uint32_t best_cost;
+	int best;
+	int idx;
 
-		/* Send packet data */
-		YM_PDEBUG( "Send packet data %d\n", packet_size );
-		if( packet_size == YM_PACKET_SIZE_128 ){
-			ym->config.putByte( ym, SOH );
+	stats->error_rate += ( (int32_t)( failed ? YM_ERROR_RATE_ONE : 0 ) - (int32_t)stats->error_rate ) / 16;
+
+	if( !(ym->config.options & YM_OPT_ADAPTIVE) ){
+		return;
+	}
+
+	ym->adapt_count ++;
+	if( ym->adapt_count < YM_ADAPT_HOLD ){
+		return;
+	}
+
+	/* A change has to gain more than 1/16 */
+	best = stats->packet_size;
+	best_cost = sizeCost( best, stats->error_rate );
+	best_cost -= best_cost / 16;
+	for( idx=0; idx<3; ++idx ){
+		int size = idx < 2 ? sizes[idx] : ym->large_size;
+		uint32_t cost;
+
+		if( size <= 0 || size == stats->packet_size ){
+			continue;
 		}
-		else{
-			ym->config.putByte( ym, STX );
+		cost = sizeCost( size, scaleErrorRate( stats->error_rate, stats->packet_size, size ) );
+		if( cost < best_cost ){
+			best = size;
+			best_cost = cost;
 		}
+	}
+
+	if( best != stats->packet_size ){
+		YM_PDEBUG( "Packet size %d -> %d, error rate %u\n", stats->packet_size, best, stats->error_rate );
+		stats->error_rate = scaleErrorRate( stats->error_rate, stats->packet_size, best );
+		stats->packet_size = best;
+		ym->adapt_count = 0;
+	}
+}
 
-		ym->config.putByte( ym, ym->packet_idx );
-		ym->config.putByte( ym, ~(ym->packet_idx) );
-		for( int idx=0; idx<packet_size; ++idx ){
-			ym->config.putByte( ym, ym->buffer[idx] );
+/* Wait for the ACK of a sent frame, sending it again on NAK */
+static int waitAck( ymodem_t *ym, const ym_frame_t *frame ){
+	int retry_cnt;
+
+	for( retry_cnt=0; retry_cnt<ym->config.num_of_retry; ++retry_cnt ){
+		if( retry_cnt > 0 ){
+			/* Send packet data again */
+			YM_PDEBUG( "Resend packet data %d\n", frame->seg_len[0]+frame->seg_len[1] );
+			if( putFrame( ym, frame ) != YM_SUCCESS ){
+				return YM_ERROR_COMM;
+			}
+			ym->stats.resends ++;
 		}
-		ym->config.putByte( ym, crc>>8 );
-		ym->config.putByte( ym, crc&0xFF );
 
 		/* Wait ack or nack */
 		YM_PDEBUG( "Wait ACK or NACK or CA\n" );
@@ -116,14 +313,14 @@ static int sendPacket( ymodem_t *ym, int packet_size ){
 		if( bdata == ACK ){
 			YM_PDEBUG( "ACK received\n" );
 			ym->packet_idx ++;
-			int cpy_size = ym->buff_idx - packet_size;
-			arrayCpy( ym->buffer, ym->buffer+packet_size, cpy_size );
-			ym->buff_idx = cpy_size;
-
+			ym->stats.packets ++;
+			countAnswer( ym, 0 );
 			return YM_SUCCESS;
 		}
 		else if( bdata == NAK ){
 			YM_PERROR( "NAK received\n" );
+			ym->stats.naks ++;
+			countAnswer( ym, 1 );
 			/* Retry */
 		}
 		else if( bdata == CA ){
@@ -141,160 +338,556 @@ static int sendPacket( ymodem_t *ym, int packet_size ){
 		}
 		else{
 			YM_PERROR( "Unexpected %x received\n", bdata );
-			/* TODO Retry */
+			ym->stats.timeouts ++;
+			countAnswer( ym, 1 );
+			/* Retry */
 		}
 	}
 
 	return YM_ERROR_TIMEOUT;
 }
 
-/* 发送头 */
-static int sendHeader( ymodem_t *ym, const char *filename, int retry_cnt ){
+/* YModem-g sends without ACK, only look for an abort from the receiver */
+static int pollAbort( ymodem_t *ym ){
 	int bdata;
-	int filename_len;
-	int packet_size;
-	int ret;
 
-	YM_PDEBUG( "YModem send header filename=%s\n", filename );
+	while( ( bdata = ym->config.getByte( ym, 0 ) ) >= 0 ){
+		if( bdata == CA ){
+			bdata = ym->config.getByte( ym, ym->config.timeout );
+			if( bdata == CA ){
+				/* Remote abort */
+				YM_PDEBUG( "Remote abort\n" );
+				return YM_ERROR_ABORT;
+			}
+			YM_PERROR( "Communition error\n" );
+			return YM_ERROR_COMM;
+		}
+		YM_PERROR( "Unexpected %x received\n", bdata );
+	}
 
-	YM_ASSERT( ym != NULL );
-	YM_ASSERT( ym->buff_idx == 0 );
+	return YM_SUCCESS;
+}
 
-	if( ym->state != YM_STATE_READY && ym->state != YM_STATE_TRANSMITING ){
-		YM_PERROR( "State error\n" );
-		return YM_ERROR_STATE;
+/* Packets allowed in flight: 0 stop and wait, 1 pipelined, more windowed */
+static int windowSize( ymodem_t *ym ){
+	if( ym->streaming ){
+		return 0;
 	}
 
-	ym->packet_idx = 0;
+	if( ym->windowed ){
+		if( ym->config.window > 0 && ym->config.window < YM_WINDOW_MAX ){
+			return ym->config.window;
+		}
+		return YM_WINDOW_MAX;
+	}
 
-	/* 如果文件名为NULL，设置空字符串 */
-	if( filename == NULL ) filename = "";
-	
-	filename_len = strLen( filename );
-	if( filename_len > YM_PACKET_SIZE_1K ){
-		YM_PERROR( "YModem filename too long\n" );
-		return YM_ERROR_FILENAME_TOO_LONG;
+	return (ym->config.options & YM_OPT_PIPELINE) ? 1 : 0;
+}
+
+/* idx-th packet in flight, 0 is the oldest */
+static ym_pending_t *pendingAt( ymodem_t *ym, int idx ){
+	return &ym->pending[ ( ym->pending_head + idx ) % YM_WINDOW_MAX ];
+}
+
+static void pushPending( ymodem_t *ym, const ym_frame_t *frame ){
+	ym_pending_t *slot = pendingAt( ym, ym->has_pending );
+
+	slot->frame = *frame;
+	slot->retry = 0;
+	slot->acked = 0;
+	ym->has_pending ++;
+}
+
+static void popPending( ymodem_t *ym ){
+	ym->pending_head = ( ym->pending_head + 1 ) % YM_WINDOW_MAX;
+	ym->has_pending --;
+}
+
+/* Send a packet in flight again */
+static int resendPending( ymodem_t *ym, ym_pending_t *slot ){
+	slot->retry ++;
+	if( slot->retry >= ym->config.num_of_retry ){
+		YM_PERROR( "Retry failed\n" );
+		return YM_ERROR_TIMEOUT;
 	}
-	packet_size = filename_len>YM_PACKET_SIZE_128 ? YM_PACKET_SIZE_1K : YM_PACKET_SIZE_128;
 
-	/* copy filename to buffer */
-	arrayCpy( ym->buffer, (const uint8_t*)filename, filename_len );
-	arraySet( ym->buffer+filename_len, 0, YM_PACKET_SIZE_1K-filename_len );
+	YM_PDEBUG( "Resend packet %d\n", slot->frame.header[1] );
+	if( putFrame( ym, &slot->frame ) != YM_SUCCESS ){
+		return YM_ERROR_COMM;
+	}
+	ym->stats.resends ++;
+	return YM_SUCCESS;
+}
 
-	ym->buff_idx = packet_size;
+/*
+ * Windowed mode, handle one answer: ACK or NAK followed by the packet number.
+ * Packets may be acknowledged out of order, the window slides once the
+ * oldest one is. A NAK sends that packet again, unless the receiver has it
+ * already, nothing heard sends the oldest one again.
+ */
+static int windowAck( ymodem_t *ym ){
+	int bdata;
+	int seq;
+	int idx;
 
-	/* Send file header */
-	while( 1 ){
-		if( retry_cnt >= 0 ){
-			if( retry_cnt == 0 ){
-				YM_PERROR( "Retry failed\n" );
-				break;
-			}
-			retry_cnt --;
+	/* Every answer is two bytes: ACK/NAK and the number, or CA CA. Read
+	 * the first one alone, so a lost byte doesn't shift the ones after */
+	YM_PDEBUG( "Wait ACK or NACK or CA, %d in flight\n", ym->has_pending );
+	bdata = ym->config.getByte( ym, ym->config.timeout );
+	if( bdata == ACK || bdata == NAK ){
+		seq = ym->config.getByte( ym, ym->config.timeout );
+		if( seq < 0 ){
+			YM_PERROR( "No packet number after %x\n", bdata );
+			return YM_SUCCESS;
 		}
 
-		YM_PDEBUG( "Wait C\n" );
-		bdata = ym->config.getByte( ym, ym->config.timeout );
-		if( bdata < 0 ){
-			YM_PERROR( "Can't read data from serial\n" );
-			continue;
+		idx = (uint8_t)( seq - ym->packet_idx );
+		if( idx >= ym->has_pending ){
+			YM_PDEBUG( "Stale %x for packet %d\n", bdata, seq );
+			return YM_SUCCESS;
+		}
+		if( bdata == NAK && pendingAt( ym, idx )->acked ){
+			/* A late NAK, the packet got through since */
+			YM_PDEBUG( "Stale NAK for packet %d\n", seq );
+			return YM_SUCCESS;
 		}
 
-		if( bdata != 'C' ){
-			YM_PERROR( "Expect receive 'C', but %x received\n", bdata );
-			continue;
+		if( bdata == NAK ){
+			YM_PERROR( "NAK received for packet %d\n", seq );
+			ym->stats.naks ++;
+			countAnswer( ym, 1 );
+			return resendPending( ym, pendingAt( ym, idx ) );
 		}
 
-		ret = sendPacket( ym, packet_size );
-		if( ret == YM_ERROR_COMM || ret == YM_ERROR_ABORT ){
-			return ret;
+		YM_PDEBUG( "ACK received for packet %d\n", seq );
+		ym->stats.packets ++;
+		countAnswer( ym, 0 );
+		pendingAt( ym, idx )->acked = 1;
+		while( ym->has_pending > 0 && pendingAt( ym, 0 )->acked ){
+			popPending( ym );
+			ym->packet_idx ++;
+		}
+		return YM_SUCCESS;
+	}
+	else if( bdata == CA ){
+		if( ym->config.getByte( ym, ym->config.timeout ) == CA ){
+			/* Remote abort */
+			YM_PDEBUG( "Remote abort\n" );
+			return YM_ERROR_ABORT;
 		}
-		if( ret == YM_SUCCESS ){
-			YM_PDEBUG( "Header send success\n" );
-			break;
-		} 
 		else{
-			/* retry */
+			/* Communication error */
+			YM_PERROR( "Communition error\n" );
+			return YM_ERROR_COMM;
 		}
 	}
-
-	if( retry_cnt == 0 ){
-		YM_PERROR( "No response.\n" );
-		return YM_ERROR_TIMEOUT;
+	else{
+		YM_PERROR( "Unexpected %x received\n", bdata );
 	}
 
-	return YM_SUCCESS;
-
+	ym->stats.timeouts ++;
+	countAnswer( ym, 1 );
+	return resendPending( ym, pendingAt( ym, 0 ) );
 }
 
+/* Handle the answer to the packets in flight */
+static int ackPending( ymodem_t *ym ){
+	int ret;
+
+	if( ym->windowed ){
+		return windowAck( ym );
+	}
 
-int ymodem_init( ymodem_t *ym ){
-	YM_ASSERT( ym->config.getByte != NULL );
-	YM_ASSERT( ym->config.putByte != NULL );
+	ret = waitAck( ym, &pendingAt( ym, 0 )->frame );
+	if( ret == YM_SUCCESS ){
+		popPending( ym );
+	}
+	return ret;
+}
 
-	ym->state = YM_STATE_READY;
-	ym->buff_idx = 0;
-	ym->packet_idx = 0;
-	do{
-		int idx;
-		for( idx=0; idx<YM_PACKET_SIZE_1K; ++idx ){
-			ym->buffer[idx] = 0;
+/* Wait until every packet in flight is acknowledged */
+static int flushPending( ymodem_t *ym ){
+	int ret;
+
+	while( ym->has_pending > 0 ){
+		ret = ackPending( ym );
+		if( ret != YM_SUCCESS ){
+			clearPending( ym );
+			return ret;
 		}
-	}while( 0 );
+	}
 
-	/* TODO */
 	return YM_SUCCESS;
 }
-/*
- * @brief 等待'C', 发送文件名
- * @param filenane 
- */
-int ymodem_startTransmit( ymodem_t *ym, const char *filename, int retry_cnt ){
-	int bdata;
-	int filename_len;
-	int packet_size;
-	int ret;
 
-	YM_PDEBUG( "YModem start transmit\n" );
-	YM_ASSERT( ym != NULL );
+/* Send a frame until it is acknowledged */
+static int sendFrame( ymodem_t *ym, const ym_frame_t *frame ){
+	int ret;
 
-	if( ym->state != YM_STATE_READY ){
-		YM_PERROR( "State error\n" );
-		return YM_ERROR_STATE;
+	YM_PDEBUG( "Send packet data %d\n", frame->seg_len[0]+frame->seg_len[1] );
+	if( putFrame( ym, frame ) != YM_SUCCESS ){
+		return YM_ERROR_COMM;
 	}
 
-	ret = sendHeader( ym, filename, retry_cnt );
-	if( ret != YM_SUCCESS ){
-		YM_PERROR( "Send header failed\n" );
-		return ret;
+	if( ym->windowed ){
+		pushPending( ym, frame );
+		return flushPending( ym );
 	}
 
-	/* Wait 'C' */
-	retry_cnt = 0;
-	while( retry_cnt < ym->config.num_of_retry ){
-		retry_cnt ++;
-		
-		YM_PDEBUG( "Wait C\n" );
-		bdata = ym->config.getByte( ym, ym->config.timeout );
-		if( bdata == 'C' ){
-			ym->state = YM_STATE_TRANSMITING;
-			return YM_SUCCESS;
-		}
-		else{
-			YM_PERROR( "Expect receive 'C', but %x received\n", bdata );
-		}
+	if( !ym->streaming ){
+		return waitAck( ym, frame );
 	}
 
-	YM_PDEBUG( "Timeout\n" );
-	return YM_ERROR_TIMEOUT;
+	/* The receiver answers the header with 'G', left for the caller */
+	ret = ym->state == YM_STATE_TRANSMITING ? pollAbort( ym ) : YM_SUCCESS;
+	if( ret == YM_SUCCESS ){
+		ym->packet_idx ++;
+	}
+	return ret;
 }
 
-int ymodem_transmit( ymodem_t *ym, const uint8_t *data, int size ){
-	YM_PDEBUG( "YModem transmit, size=%d, buffer idx=%d\n", size, ym->buff_idx );
+/*
+ * Pipelined send: this frame was prepared while earlier ones were on their
+ * way. Once the window has room it is sent right away, its ACK is collected
+ * later. The frame must stay valid until then.
+ */
+static int queueFrame( ymodem_t *ym, const ym_frame_t *frame ){
+	int ret;
 
-	YM_ASSERT( ym != NULL );
-	YM_ASSERT( data != NULL );
-	YM_ASSERT( size > 0 );
+	while( ym->has_pending >= windowSize( ym ) ){
+		ret = ackPending( ym );
+		if( ret != YM_SUCCESS ){
+			clearPending( ym );
+			return ret;
+		}
+	}
+
+	YM_PDEBUG( "Send packet data %d, ACK pending\n", frame->seg_len[0]+frame->seg_len[1] );
+	if( putFrame( ym, frame ) != YM_SUCCESS ){
+		return YM_ERROR_COMM;
+	}
+	pushPending( ym, frame );
+
+	return YM_SUCCESS;
+}
+
+/* Sequence number of the next packet, ahead by the packets in flight */
+static uint8_t nextSeq( ymodem_t *ym ){
+	return ym->packet_idx + ym->has_pending;
+}
+
+/* Send the first packet_size staged bytes, pipelined if allowed */
+static int sendPacket( ymodem_t *ym, int packet_size, int pipelined ){
+	uint8_t *payload = YM_DATA( ym ) + ym->buff_head;
+	uint8_t *trailer = NULL;
+	uint8_t saved[ PACKET_TRAILER_SIZE ];
+	ym_frame_t frame;
+	uint16_t crc;
+	int part;
+	int ret;
+
+	YM_ASSERT( packet_size==YM_PACKET_SIZE_128 || packet_size==YM_PACKET_SIZE_1K );
+	YM_ASSERT( packet_size <= ym->buff_idx );
+
+	/* ym->crc already covers the whole staged data */
+	if( packet_size == ym->buff_idx ){
+		crc = ym->crc;
+	}
+	else{
+		crc = stagedCRC( ym, packet_size );
+	}
+
+	part = ringSpan( ym->buff_head, packet_size );
+	initFrame( &frame, nextSeq( ym ), payload, part, YM_DATA( ym ), packet_size-part, crc );
+
+	/* Frame the packet in place unless it wraps or the bytes before it are
+	 * still staged. The CRC of a short packet may land on staged data, keep
+	 * it aside until the packet is done */
+	if( part == packet_size && ( ym->buff_head == 0 ||
+			( ym->buff_head >= (int)PACKET_HEADER_SIZE && ym->buff_idx <= (int)(YM_PACKET_SIZE_1K-PACKET_HEADER_SIZE) ) ) ){
+		trailer = payload + packet_size;
+		arrayCpy( saved, trailer, PACKET_TRAILER_SIZE );
+		arrayCpy( payload-PACKET_HEADER_SIZE, frame.header, PACKET_HEADER_SIZE );
+		arrayCpy( trailer, frame.trailer, PACKET_TRAILER_SIZE );
+		frame.frame = payload - PACKET_HEADER_SIZE;
+	}
+
+	if( pipelined && windowSize( ym ) > 0 && packet_size == ym->buff_idx ){
+		/* The packet takes the whole buffer, leave it there until the ACK
+		 * and stage into the next one. Buffers are freed in the order they
+		 * are used, so the next one is free */
+		ret = queueFrame( ym, &frame );
+		if( ret == YM_SUCCESS ){
+			ym->buff = ( ym->buff + 1 ) % (YM_WINDOW_MAX+1);
+			ym->buff_head = 0;
+			ym->buff_idx = 0;
+			ym->crc = 0;
+		}
+		return ret;
+	}
+
+	ret = flushPending( ym );
+	if( ret == YM_SUCCESS ){
+		ret = sendFrame( ym, &frame );
+	}
+
+	if( trailer != NULL ){
+		arrayCpy( trailer, saved, PACKET_TRAILER_SIZE );
+	}
+
+	if( ret == YM_SUCCESS ){
+		ym->buff_idx -= packet_size;
+		ym->buff_head = ( ym->buff_head + packet_size ) % YM_PACKET_SIZE_1K;
+		if( ym->buff_idx == 0 ){
+			ym->buff_head = 0;
+			ym->crc = 0;
+		}
+		else{
+			ym->crc = stagedCRC( ym, ym->buff_idx );
+		}
+	}
+
+	return ret;
+}
+
+/* Send a 1K or large block straight from the caller's memory, nothing is staged */
+static int sendDirect( ymodem_t *ym, const uint8_t *data, int size ){
+	ym_frame_t frame;
+
+	initFrame( &frame, nextSeq( ym ), data, size, NULL, 0,
+			size == YM_PACKET_SIZE_1K ? Cal_CRC16( data, size ) : Cal_CRC32( data, size ) );
+
+	if( windowSize( ym ) > 0 ){
+		return queueFrame( ym, &frame );
+	}
+
+	return sendFrame( ym, &frame );
+}
+
+/* Large packet size to offer, 0 if none or not valid */
+static int largeOffer( ymodem_t *ym ){
+	int size = ym->config.large_block;
+
+	if( size < YM_PACKET_SIZE_4K || size > YM_PACKET_SIZE_32K || (size & (size-1)) != 0 ){
+		return 0;
+	}
+	return size;
+}
+
+/*
+ * Stage the file header packet, large packets are offered if offer_large
+ * is set
+ * @ret Packet size, <0: error
+ */
+static int stageHeader( ymodem_t *ym, const char *filename, int offer_large ){
+	int filename_len;
+	int packet_size;
+	int offer_len;
+	uint8_t offer[4];
+
+	/* 如果文件名为NULL，设置空字符串 */
+	if( filename == NULL ) filename = "";
+	
+	filename_len = strLen( filename );
+	if( filename_len > YM_PACKET_SIZE_1K ){
+		YM_PERROR( "YModem filename too long\n" );
+		return YM_ERROR_FILENAME_TOO_LONG;
+	}
+
+	/* Large packets are offered after the file info, which is left empty:
+	 * filename NUL NUL 'L' size-in-KB. Other receivers stop reading at the
+	 * file info */
+	offer_len = 0;
+	ym->large_size = 0;
+	if( filename_len > 0 && offer_large && largeOffer( ym ) > 0 ){
+		int kb = largeOffer( ym ) / YM_PACKET_SIZE_1K;
+
+		offer[ offer_len++ ] = YMODEM_L;
+		if( kb >= 10 ){
+			offer[ offer_len++ ] = '0' + kb/10;
+		}
+		offer[ offer_len++ ] = '0' + kb%10;
+		if( filename_len + 2 + offer_len > YM_PACKET_SIZE_1K ){
+			offer_len = 0;
+		}
+	}
+
+	packet_size = filename_len + (offer_len ? 2+offer_len : 0) > YM_PACKET_SIZE_128 ? YM_PACKET_SIZE_1K : YM_PACKET_SIZE_128;
+
+	/* copy filename to buffer */
+	arrayCpy( YM_DATA( ym ), (const uint8_t*)filename, filename_len );
+	arraySet( YM_DATA( ym )+filename_len, 0, YM_PACKET_SIZE_1K-filename_len );
+	arrayCpy( YM_DATA( ym )+filename_len+2, offer, offer_len );
+
+	ym->buff_idx = packet_size;
+	ym->crc = Cal_CRC16( YM_DATA( ym ), packet_size );
+
+	return packet_size;
+}
+
+/* 发送头 */
+static int sendHeader( ymodem_t *ym, const char *filename, int retry_cnt ){
+	int bdata;
+	int packet_size;
+	int ret;
+
+	YM_PDEBUG( "YModem send header filename=%s\n", filename );
+
+	YM_ASSERT( ym != NULL );
+	YM_ASSERT( ym->buff_idx == 0 );
+	ym->buff_head = 0;
+
+	if( ym->state != YM_STATE_READY && ym->state != YM_STATE_TRANSMITING ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	ym->packet_idx = 0;
+
+	packet_size = stageHeader( ym, filename, 1 );
+	if( packet_size < 0 ){
+		return packet_size;
+	}
+
+	/* Send file header */
+	while( 1 ){
+		if( retry_cnt >= 0 ){
+			if( retry_cnt == 0 ){
+				YM_PERROR( "Retry failed\n" );
+				break;
+			}
+			retry_cnt --;
+		}
+
+		YM_PDEBUG( "Wait C\n" );
+		bdata = ym->config.getByte( ym, ym->config.timeout );
+		if( bdata < 0 ){
+			YM_PERROR( "Can't read data from serial\n" );
+			continue;
+		}
+
+		if( bdata == YMODEM_G && (ym->config.options & YM_OPT_STREAMING) ){
+			YM_PDEBUG( "YModem-g requested\n" );
+		}
+		else if( bdata == YMODEM_W && (ym->config.options & YM_OPT_WINDOW) ){
+			YM_PDEBUG( "Windowed transfer requested\n" );
+		}
+		else if( bdata != 'C' ){
+			YM_PERROR( "Expect receive 'C', but %x received\n", bdata );
+			continue;
+		}
+		ym->streaming = ( bdata == YMODEM_G );
+		ym->windowed = ( bdata == YMODEM_W );
+
+		ret = sendPacket( ym, packet_size, 0 );
+		if( ret == YM_ERROR_COMM || ret == YM_ERROR_ABORT ){
+			return ret;
+		}
+		if( ret == YM_SUCCESS ){
+			YM_PDEBUG( "Header send success\n" );
+			break;
+		} 
+		else{
+			/* retry */
+		}
+	}
+
+	if( retry_cnt == 0 ){
+		YM_PERROR( "No response.\n" );
+		return YM_ERROR_TIMEOUT;
+	}
+
+	return YM_SUCCESS;
+
+}
+
+
+int ymodem_init( ymodem_t *ym ){
+	YM_ASSERT( ym->config.getByte != NULL );
+	YM_ASSERT( ym->config.putByte != NULL );
+
+	ym->state = YM_STATE_READY;
+	ym->buff = 0;
+	ym->buff_idx = 0;
+	ym->buff_head = 0;
+	ym->packet_idx = 0;
+	ym->crc = 0;
+	ym->pending_head = 0;
+	ym->has_pending = 0;
+	ym->streaming = 0;
+	ym->windowed = 0;
+	ym->large_size = 0;
+	ym->adapt_count = 0;
+	arraySet( (uint8_t*)&ym->stats, 0, sizeof(ym->stats) );
+	arraySet( &ym->packet[0][0], 0, sizeof(ym->packet) );
+
+	/* TODO */
+	return YM_SUCCESS;
+}
+/*
+ * @brief 等待'C', 发送文件名
+ * @param filenane 
+ */
+int ymodem_startTransmit( ymodem_t *ym, const char *filename, int retry_cnt ){
+	int bdata;
+	int filename_len;
+	int packet_size;
+	int ret;
+
+	YM_PDEBUG( "YModem start transmit\n" );
+	YM_ASSERT( ym != NULL );
+
+	if( ym->state != YM_STATE_READY ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	ret = sendHeader( ym, filename, retry_cnt );
+	if( ret != YM_SUCCESS ){
+		YM_PERROR( "Send header failed\n" );
+		return ret;
+	}
+
+	/* Wait 'C' */
+	retry_cnt = 0;
+	while( retry_cnt < ym->config.num_of_retry ){
+		retry_cnt ++;
+		
+		YM_PDEBUG( "Wait C\n" );
+		bdata = ym->config.getByte( ym, ym->config.timeout );
+		if( bdata == 'C' || (ym->streaming && bdata == YMODEM_G) || (ym->windowed && bdata == YMODEM_W) ){
+			ym->stats.packet_size = ym->large_size > 0 ? ym->large_size : YM_PACKET_SIZE_1K;
+			ym->adapt_count = 0;
+			ym->state = YM_STATE_TRANSMITING;
+			return YM_SUCCESS;
+		}
+		else if( bdata == YMODEM_L && largeOffer( ym ) > 0 ){
+			/* The receiver takes large packets up to this size */
+			bdata = ym->config.getByte( ym, ym->config.timeout );
+			if( bdata >= YM_PACKET_SIZE_4K/YM_PACKET_SIZE_1K && bdata*YM_PACKET_SIZE_1K <= largeOffer( ym ) &&
+					(bdata & (bdata-1)) == 0 ){
+				ym->large_size = bdata * YM_PACKET_SIZE_1K;
+				YM_PDEBUG( "Large packets of %d bytes\n", ym->large_size );
+			}
+			else{
+				YM_PERROR( "Bad large packet size %x\n", bdata );
+			}
+		}
+		else{
+			YM_PERROR( "Expect receive 'C', but %x received\n", bdata );
+		}
+	}
+
+	YM_PDEBUG( "Timeout\n" );
+	return YM_ERROR_TIMEOUT;
+}
+
+int ymodem_transmit( ymodem_t *ym, const uint8_t *data, int size ){
+	YM_PDEBUG( "YModem transmit, size=%d, buffer idx=%d\n", size, ym->buff_idx );
+
+	YM_ASSERT( ym != NULL );
+	YM_ASSERT( data != NULL );
+	YM_ASSERT( size > 0 );
 
 	if( ym->state != YM_STATE_TRANSMITING ){
 		YM_PERROR( "State error\n" );
@@ -302,31 +895,67 @@ int ymodem_transmit( ymodem_t *ym, const uint8_t *data, int size ){
 	}
 
 	int ret;
+	/* Packets in flight may still wait for their ACK when we return, so the
+	 * last blocks of the caller's data always go through the buffers */
+	int direct_min = ( windowSize( ym ) + 1 ) * YM_PACKET_SIZE_1K;
 
 	while( size > 0 ){
-		/* Copy data to buffer */
-		int cpy_size = YM_PACKET_SIZE_1K - ym->buff_idx;
+		if( ym->large_size > 0 && ym->stats.packet_size >= ym->large_size &&
+				ym->buff_idx == 0 && size >= ym->large_size - YM_PACKET_SIZE_1K + direct_min ){
+			/* Whole large block available */
+			YM_PDEBUG( "Send large packet from caller data\n" );
+			ret = sendDirect( ym, data, ym->large_size );
+			if( ret != YM_SUCCESS ){
+				return ret;
+			}
+			data = data + ym->large_size;
+			size = size - ym->large_size;
+			continue;
+		}
+
+		if( ym->stats.packet_size >= YM_PACKET_SIZE_1K && ym->buff_idx == 0 && size >= direct_min ){
+			/* Whole 1K block available, no need to stage it */
+			YM_PDEBUG( "Send 1K-packet from caller data\n" );
+			ret = sendDirect( ym, data, YM_PACKET_SIZE_1K );
+			if( ret != YM_SUCCESS ){
+				return ret;
+			}
+			data = data + YM_PACKET_SIZE_1K;
+			size = size - YM_PACKET_SIZE_1K;
+			continue;
+		}
+
+		/* Copy data to buffer, a 128B-packet at a time when the adaptive
+		 * size is down to that. If it dropped with more than that staged,
+		 * nothing is copied until the staged bytes went out in 128B-packets */
+		int cpy_size = ( ym->stats.packet_size == YM_PACKET_SIZE_128 ? YM_PACKET_SIZE_128 : YM_PACKET_SIZE_1K ) - ym->buff_idx;
+		if( cpy_size < 0 ){
+			cpy_size = 0;
+		}
 		if( cpy_size > size ){
 			cpy_size = size;
 		}
 
-		arrayCpy( ym->buffer+ym->buff_idx, data, cpy_size );
-		ym->buff_idx += cpy_size;
+		/* Copy and CRC in one pass */
+		if( cpy_size > 0 ){
+			stageData( ym, data, cpy_size );
+		}
 		data = data + cpy_size;
 		size = size - cpy_size;
 
 		if( ym->buff_idx == YM_PACKET_SIZE_1K ){
 			/* Send 1K-packet */
 			YM_PDEBUG( "Send 1K-packet\n" );
-			ret = sendPacket( ym, YM_PACKET_SIZE_1K );
+			ret = sendPacket( ym, YM_PACKET_SIZE_1K, 1 );
 			if( ret != YM_SUCCESS ){
 				return ret;
 			}
 		}
-		else if( ym->buff_idx >= YM_PACKET_SIZE_128 ){
+		else if( ( ym->config.packet_policy == YM_POLICY_EAGER || ym->stats.packet_size == YM_PACKET_SIZE_128 ) &&
+				ym->buff_idx >= YM_PACKET_SIZE_128 ){
 			/* Send 128B-packet */
 			YM_PDEBUG( "Send 128-packet\n" );
-			ret = sendPacket( ym, YM_PACKET_SIZE_128 );
+			ret = sendPacket( ym, YM_PACKET_SIZE_128, 1 );
 			if( ret != YM_SUCCESS ){
 				return ret;
 			}
@@ -336,6 +965,37 @@ int ymodem_transmit( ymodem_t *ym, const uint8_t *data, int size ){
 	return YM_SUCCESS;
 }
 
+/*
+ * @brief Choose how to send the tail left in the buffer
+ *        Every packet costs its header, CRC and an ACK round trip of
+ *        YM_TURNAROUND_BYTES byte times, the mix of 1K and 128B-packets with
+ *        the lowest total is used. 1K-packets go first, the last packet is
+ *        padded.
+ * @param size Bytes left
+ * @ret   Number of 1K-packets, the rest goes in 128B-packets
+ */
+static int tailPlan( int size ){
+	const int cost_1k = PACKET_HEADER_SIZE + YM_PACKET_SIZE_1K + PACKET_TRAILER_SIZE + YM_TURNAROUND_BYTES;
+	const int cost_128 = PACKET_HEADER_SIZE + YM_PACKET_SIZE_128 + PACKET_TRAILER_SIZE + YM_TURNAROUND_BYTES;
+	int best_1k = 0;
+	int best_cost = -1;
+	int num_1k;
+
+	for( num_1k=0; num_1k*YM_PACKET_SIZE_1K < size+YM_PACKET_SIZE_1K; ++num_1k ){
+		int remain = size - num_1k*YM_PACKET_SIZE_1K;
+		int num_128 = remain > 0 ? (remain+YM_PACKET_SIZE_128-1) / YM_PACKET_SIZE_128 : 0;
+		int cost = num_1k*cost_1k + num_128*cost_128;
+
+		/* On a tie the fewer packets win */
+		if( best_cost < 0 || cost <= best_cost ){
+			best_cost = cost;
+			best_1k = num_1k;
+		}
+	}
+
+	return best_1k;
+}
+
 int ymodem_finishTransmit( ymodem_t *ym ){
 	int ret;
 
@@ -349,15 +1009,19 @@ int ymodem_finishTransmit( ymodem_t *ym ){
 	YM_PDEBUG( "Finish transmit\n" );
 	/* Send remain data in buffer */
 	if( ym->buff_idx != 0 ){
-		arraySet( ym->buffer+ym->buff_idx, 0, YM_PACKET_SIZE_1K-ym->buff_idx );
+		int num_1k = ym->stats.packet_size == YM_PACKET_SIZE_128 ? 0 : tailPlan( ym->buff_idx );
 
-		if( ym->buff_idx > YM_PACKET_SIZE_1K ){
-			ym->buff_idx = YM_PACKET_SIZE_1K;
-			ret = sendPacket( ym, YM_PACKET_SIZE_1K );
-		}
-		else{
-			ym->buff_idx = YM_PACKET_SIZE_128;
-			ret = sendPacket( ym, YM_PACKET_SIZE_128 );
+		ret = YM_SUCCESS;
+		while( ret == YM_SUCCESS && ym->buff_idx > 0 ){
+			int packet_size = num_1k > 0 ? YM_PACKET_SIZE_1K : YM_PACKET_SIZE_128;
+
+			if( ym->buff_idx < packet_size ){
+				padData( ym, packet_size-ym->buff_idx );
+			}
+			ret = sendPacket( ym, packet_size, 1 );
+			if( packet_size == YM_PACKET_SIZE_1K ){
+				num_1k --;
+			}
 		}
 
 		if( ret != YM_SUCCESS ){
@@ -365,13 +1029,26 @@ int ymodem_finishTransmit( ymodem_t *ym ){
 		}
 	}
 
-	arraySet( ym->buffer, 0, YM_PACKET_SIZE_1K );
+	ret = flushPending( ym );
+	if( ret != YM_SUCCESS ){
+		YM_PERROR( "Send error\n" );
+	}
+	if( ym->state != YM_STATE_TRANSMITING ){
+		/* Aborted, the line failed */
+		return YM_ERROR_COMM;
+	}
+
+	arraySet( YM_DATA( ym ), 0, YM_PACKET_SIZE_1K );
+	ym->buff_idx = 0;
+	ym->buff_head = 0;
+	ym->crc = 0;
 	
 	/* Send EOT */
 	for( int idx=0; idx<10; ++idx ){
 		/* Send EOT */
 		YM_PDEBUG( "Send EOT\n" );
 		ym->config.putByte( ym, EOT );
+		putFlush( ym );
 		/* Wait ACK */
 		YM_PDEBUG( "Wait ACK\n" );
 		ret = ym->config.getByte( ym, ym->config.timeout );
@@ -392,3 +1069,1200 @@ int ymodem_finishTransmit( ymodem_t *ym ){
 	return YM_ERROR_TIMEOUT;
 }
 
+/* Non-blocking transmit phases */
+#define YM_TX_HANDSHAKE  (0) /* wait for the receiver to ask for the header */
+#define YM_TX_HEADER     (1) /* file header in flight */
+#define YM_TX_START      (2) /* wait for the receiver to ask for data */
+#define YM_TX_DATA       (3)
+#define YM_TX_EOT        (4) /* EOT sent, wait for its ACK */
+#define YM_TX_CLOSE      (5) /* wait for the receiver to ask for the next header */
+#define YM_TX_FINAL      (6) /* empty header in flight */
+
+/* out_idx when nothing is being written */
+#define YM_TX_OUT_IDLE   (4)
+
+/* Tries of EOT, and of the request for the empty header */
+#define YM_TX_EOT_TRIES    (10)
+#define YM_TX_CLOSE_TRIES  (5)
+
+/* Packets in flight, one at least */
+static int txWindow( ymodem_t *ym ){
+	int window = windowSize( ym );
+	return window > 0 ? window : 1;
+}
+
+/* Frame size bytes at data in place, with room for the header before and
+ * the CRC after it */
+static void framePacket( ym_frame_t *frame, uint8_t seq, uint8_t *data, int size ){
+	initFrame( frame, seq, data, size, NULL, 0, Cal_CRC16( data, size ) );
+	arrayCpy( data-PACKET_HEADER_SIZE, frame->header, PACKET_HEADER_SIZE );
+	arrayCpy( data+size, frame->trailer, PACKET_TRAILER_SIZE );
+	frame->frame = data - PACKET_HEADER_SIZE;
+}
+
+/* Frame the file header, or the empty one, as the next packet to send */
+static int txHeader( ymodem_t *ym, const char *filename ){
+	int size;
+
+	ym->buff = 0;
+	ym->buff_head = 0;
+	size = stageHeader( ym, filename, 0 );
+	ym->buff_idx = 0;
+	ym->crc = 0;
+	if( size < 0 ){
+		return size;
+	}
+
+	ym->packet_idx = 0;
+	clearPending( ym );
+	ym->tx.resend = 0;
+	framePacket( &ym->tx.next, 0, YM_DATA( ym ), size );
+	return YM_SUCCESS;
+}
+
+/*
+ * Read the next data packet into its packet buffer, a packet number maps
+ * to a buffer. Packets are 1K unless YM_OPT_ADAPTIVE went down to 128B.
+ * The last block goes in one 1K or a few 128B-packets, as tailPlan says.
+ * Once all is acknowledged the EOT follows.
+ */
+static int txData( ymodem_t *ym ){
+	ym_tx_t *tx = &ym->tx;
+	int seq = ym->packet_idx + ym->has_pending;
+	int want = ym->stats.packet_size == YM_PACKET_SIZE_128 ? YM_PACKET_SIZE_128 : YM_PACKET_SIZE_1K;
+	uint8_t *data;
+	int size;
+
+	if( tx->tail_size > 0 ){
+		initFrame( &tx->next, seq, tx->tail, YM_PACKET_SIZE_128, NULL, 0,
+				Cal_CRC16( tx->tail, YM_PACKET_SIZE_128 ) );
+		tx->tail += YM_PACKET_SIZE_128;
+		tx->tail_size -= YM_PACKET_SIZE_128;
+		tx->has_next = 1;
+		return YM_SUCCESS;
+	}
+
+	if( !tx->eof ){
+		data = ym->packet[ seq % (YM_WINDOW_MAX+1) ] + PACKET_DATA_INDEX;
+		size = ym->config.readData( ym, data, want );
+		if( size < 0 ){
+			YM_PERROR( "Read error\n" );
+			return YM_ERROR_READ;
+		}
+		if( size == want ){
+			framePacket( &tx->next, seq, data, want );
+			tx->has_next = 1;
+			return YM_SUCCESS;
+		}
+
+		tx->eof = 1;
+		if( size > 0 ){
+			arraySet( data+size, 0, YM_PACKET_SIZE_1K-size );
+			if( tailPlan( size ) > 0 ){
+				framePacket( &tx->next, seq, data, YM_PACKET_SIZE_1K );
+				tx->has_next = 1;
+				return YM_SUCCESS;
+			}
+			tx->tail = data;
+			tx->tail_size = ( size+YM_PACKET_SIZE_128-1 ) / YM_PACKET_SIZE_128 * YM_PACKET_SIZE_128;
+			return txData( ym );
+		}
+	}
+
+	if( ym->has_pending == 0 ){
+		YM_PDEBUG( "Send EOT\n" );
+		tx->phase = YM_TX_EOT;
+		tx->retry = 0;
+		tx->eot = 1;
+	}
+	return YM_SUCCESS;
+}
+
+/* Start writing a frame */
+static void setOut( ymodem_t *ym, const ym_frame_t *frame, int first ){
+	ym_tx_t *tx = &ym->tx;
+	int idx;
+
+	tx->out = *frame;
+	for( idx=0; idx<YM_TX_OUT_IDLE; ++idx ){
+		tx->out_len[idx] = 0;
+	}
+	if( frame->frame != NULL ){
+		tx->out_seg[0] = frame->frame;
+		tx->out_len[0] = PACKET_HEADER_SIZE + frame->seg_len[0] + frame->trailer_len;
+	}
+	else{
+		tx->out_seg[0] = tx->out.header;
+		tx->out_len[0] = PACKET_HEADER_SIZE;
+		tx->out_seg[1] = frame->seg[0];
+		tx->out_len[1] = frame->seg_len[0];
+		tx->out_seg[2] = frame->seg[1];
+		tx->out_len[2] = frame->seg_len[1];
+		tx->out_seg[3] = tx->out.trailer;
+		tx->out_len[3] = frame->trailer_len;
+	}
+	tx->out_idx = 0;
+	tx->out_pos = 0;
+	tx->out_new = first;
+}
+
+/* Pick what to write next: packets to send again, oldest first, then a
+ * new packet, then EOT */
+static int fillOut( ymodem_t *ym ){
+	static const uint8_t eot = EOT;
+	ym_tx_t *tx = &ym->tx;
+	int idx;
+	int ret;
+
+	if( tx->out_idx != YM_TX_OUT_IDLE ){
+		return YM_SUCCESS;
+	}
+
+	for( idx=0; tx->resend != 0 && idx<ym->has_pending; ++idx ){
+		if( tx->resend & ( (uint64_t)1<<idx ) ){
+			tx->resend &= ~( (uint64_t)1<<idx );
+			if( !pendingAt( ym, idx )->acked ){
+				YM_PDEBUG( "Resend packet %d\n", pendingAt( ym, idx )->frame.header[1] );
+				setOut( ym, &pendingAt( ym, idx )->frame, 0 );
+				return YM_SUCCESS;
+			}
+		}
+	}
+
+	if( !tx->has_next && tx->phase == YM_TX_DATA &&
+			( ym->streaming || ym->has_pending < txWindow( ym ) ) ){
+		ret = txData( ym );
+		if( ret != YM_SUCCESS ){
+			return ret;
+		}
+	}
+
+	if( tx->has_next ){
+		YM_PDEBUG( "Send packet %d\n", tx->next.header[1] );
+		tx->has_next = 0;
+		if( !ym->streaming ){
+			pushPending( ym, &tx->next );
+		}
+		setOut( ym, &tx->next, 1 );
+	}
+	else if( tx->eot ){
+		tx->eot = 0;
+		for( idx=1; idx<YM_TX_OUT_IDLE; ++idx ){
+			tx->out_len[idx] = 0;
+		}
+		tx->out_seg[0] = &eot;
+		tx->out_len[0] = 1;
+		tx->out_idx = 0;
+		tx->out_pos = 0;
+		tx->out_new = 0;
+	}
+	return YM_SUCCESS;
+}
+
+/* A frame is written. YModem-g packets are not answered, they are done */
+static int txWritten( ymodem_t *ym ){
+	ym_tx_t *tx = &ym->tx;
+
+	if( !ym->streaming || !tx->out_new ){
+		return YM_SUCCESS;
+	}
+
+	ym->packet_idx ++;
+	if( tx->phase == YM_TX_HEADER ){
+		tx->phase = YM_TX_START;
+		tx->retry = 0;
+	}
+	else if( tx->phase == YM_TX_FINAL ){
+		return YM_DONE;
+	}
+	return YM_SUCCESS;
+}
+
+/* Send the idx-th packet in flight again */
+static int txResend( ymodem_t *ym, int idx ){
+	ym_pending_t *slot;
+
+	if( idx >= ym->has_pending ){
+		return YM_SUCCESS;
+	}
+
+	slot = pendingAt( ym, idx );
+	slot->retry ++;
+	if( slot->retry >= ym->config.num_of_retry ){
+		YM_PERROR( "Retry failed\n" );
+		return YM_ERROR_TIMEOUT;
+	}
+	ym->stats.resends ++;
+	ym->tx.resend |= (uint64_t)1 << idx;
+	return YM_SUCCESS;
+}
+
+/* The idx-th packet in flight is acknowledged, the window slides once the
+ * oldest one is */
+static int txAck( ymodem_t *ym, int idx ){
+	ym_tx_t *tx = &ym->tx;
+
+	if( idx >= ym->has_pending ){
+		YM_PDEBUG( "Stale ACK\n" );
+		return YM_SUCCESS;
+	}
+
+	ym->stats.packets ++;
+	countAnswer( ym, 0 );
+	pendingAt( ym, idx )->acked = 1;
+	while( ym->has_pending > 0 && pendingAt( ym, 0 )->acked ){
+		popPending( ym );
+		ym->packet_idx ++;
+		tx->resend >>= 1;
+	}
+
+	if( ym->has_pending == 0 && tx->phase == YM_TX_HEADER ){
+		YM_PDEBUG( "Header send success\n" );
+		tx->phase = YM_TX_START;
+		tx->retry = 0;
+	}
+	else if( ym->has_pending == 0 && tx->phase == YM_TX_FINAL ){
+		return YM_DONE;
+	}
+	return YM_SUCCESS;
+}
+
+/* No answer to the packets in flight, send the oldest again */
+static int txTimeout( ymodem_t *ym ){
+	if( ym->streaming || ym->has_pending == 0 ){
+		return YM_SUCCESS;
+	}
+	ym->stats.timeouts ++;
+	countAnswer( ym, 1 );
+	return txResend( ym, 0 );
+}
+
+/* A request for a header didn't come */
+static int txTry( ymodem_t *ym ){
+	if( ym->tx.tries > 0 && --ym->tx.tries == 0 ){
+		YM_PERROR( "No response.\n" );
+		return YM_ERROR_TIMEOUT;
+	}
+	return YM_SUCCESS;
+}
+
+/* EOT not acknowledged, send it again or go on without */
+static void txEot( ymodem_t *ym ){
+	ym_tx_t *tx = &ym->tx;
+
+	tx->retry ++;
+	if( tx->retry < YM_TX_EOT_TRIES ){
+		tx->eot = 1;
+		return;
+	}
+	tx->phase = YM_TX_CLOSE;
+	tx->tries = YM_TX_CLOSE_TRIES;
+}
+
+/* Handle one byte from the receiver */
+static int txByte( ymodem_t *ym, uint8_t bdata ){
+	ym_tx_t *tx = &ym->tx;
+	int answer = tx->answer;
+	int ret;
+
+	if( answer >= 0 ){
+		tx->answer = -1;
+		if( answer == CA ){
+			if( bdata == CA ){
+				/* Remote abort */
+				YM_PDEBUG( "Remote abort\n" );
+				return YM_ERROR_ABORT;
+			}
+			YM_PERROR( "Communition error\n" );
+			return YM_ERROR_COMM;
+		}
+
+		/* Windowed answer, the packet number follows ACK or NAK */
+		if( answer == NAK ){
+			YM_PERROR( "NAK received for packet %d\n", bdata );
+			if( (uint8_t)( bdata - ym->packet_idx ) >= ym->has_pending ||
+					pendingAt( ym, (uint8_t)( bdata - ym->packet_idx ) )->acked ){
+				/* Stale, the receiver has it */
+				return YM_SUCCESS;
+			}
+			ym->stats.naks ++;
+			countAnswer( ym, 1 );
+			return txResend( ym, (uint8_t)( bdata - ym->packet_idx ) );
+		}
+		YM_PDEBUG( "ACK received for packet %d\n", bdata );
+		return txAck( ym, (uint8_t)( bdata - ym->packet_idx ) );
+	}
+
+	if( bdata == CA ){
+		tx->answer = CA;
+		return YM_SUCCESS;
+	}
+
+	switch( tx->phase ){
+	case YM_TX_HANDSHAKE:
+	case YM_TX_CLOSE:
+		if( bdata == CRC16 || ( bdata == YMODEM_G && (ym->config.options & YM_OPT_STREAMING) ) ||
+				( bdata == YMODEM_W && (ym->config.options & YM_OPT_WINDOW) ) ){
+			ym->streaming = ( bdata == YMODEM_G );
+			ym->windowed = ( bdata == YMODEM_W );
+			if( tx->phase == YM_TX_CLOSE ){
+				YM_PDEBUG( "Send empty header\n" );
+				ret = txHeader( ym, NULL );
+				if( ret != YM_SUCCESS ){
+					return ret;
+				}
+			}
+			tx->phase = tx->phase == YM_TX_HANDSHAKE ? YM_TX_HEADER : YM_TX_FINAL;
+			tx->has_next = 1;
+			return YM_SUCCESS;
+		}
+		YM_PERROR( "Expect receive 'C', but %x received\n", bdata );
+		return txTry( ym );
+
+	case YM_TX_START:
+		if( bdata == CRC16 || ( ym->streaming && bdata == YMODEM_G ) || ( ym->windowed && bdata == YMODEM_W ) ){
+			ym->stats.packet_size = YM_PACKET_SIZE_1K;
+			ym->adapt_count = 0;
+			tx->phase = YM_TX_DATA;
+			return YM_SUCCESS;
+		}
+		YM_PERROR( "Expect receive 'C', but %x received\n", bdata );
+		if( ++tx->retry >= ym->config.num_of_retry ){
+			return YM_ERROR_TIMEOUT;
+		}
+		return YM_SUCCESS;
+
+	case YM_TX_EOT:
+		if( bdata == ACK ){
+			YM_PDEBUG( "ACK received\n" );
+			tx->phase = YM_TX_CLOSE;
+			tx->tries = YM_TX_CLOSE_TRIES;
+		}
+		else{
+			YM_PDEBUG( "%x received, retry\n", bdata );
+			txEot( ym );
+		}
+		return YM_SUCCESS;
+
+	default:
+		/* Answers to the packets in flight */
+		if( ym->streaming ){
+			YM_PERROR( "Unexpected %x received\n", bdata );
+			return YM_SUCCESS;
+		}
+		if( ym->windowed && ( bdata == ACK || bdata == NAK ) ){
+			tx->answer = bdata;
+			return YM_SUCCESS;
+		}
+		if( !ym->windowed && bdata == ACK ){
+			YM_PDEBUG( "ACK received\n" );
+			return txAck( ym, 0 );
+		}
+		if( !ym->windowed && bdata == NAK && ym->has_pending > 0 ){
+			YM_PERROR( "NAK received\n" );
+			ym->stats.naks ++;
+			countAnswer( ym, 1 );
+			return txResend( ym, 0 );
+		}
+		YM_PERROR( "Unexpected %x received\n", bdata );
+		return txTimeout( ym );
+	}
+}
+
+/* The session is over, done or failed */
+static int txEnd( ymodem_t *ym, int ret ){
+	if( ret != YM_DONE ){
+		YM_PERROR( "Transmit failed %d\n", ret );
+	}
+	clearPending( ym );
+	ym->tx.out_idx = YM_TX_OUT_IDLE;
+	ym->state = YM_STATE_READY;
+	return ret;
+}
+
+/*
+ * @brief Start a non-blocking transmit of one file, its data comes from
+ *        config.readData. Large packets are not offered.
+ * @param retry_cnt Header requests to wait for, <0: no limit
+ */
+int ymodem_pollTransmit( ymodem_t *ym, const char *filename, int retry_cnt ){
+	ym_tx_t *tx = &ym->tx;
+	int ret;
+
+	YM_PDEBUG( "YModem poll transmit\n" );
+	YM_ASSERT( ym != NULL );
+	YM_ASSERT( ym->config.readData != NULL );
+
+	if( ym->state != YM_STATE_READY ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+	if( retry_cnt == 0 ){
+		return YM_ERROR_TIMEOUT;
+	}
+
+	arraySet( (uint8_t*)tx, 0, sizeof(*tx) );
+	tx->phase = YM_TX_HANDSHAKE;
+	tx->tries = retry_cnt;
+	tx->answer = -1;
+	tx->out_idx = YM_TX_OUT_IDLE;
+	ym->streaming = 0;
+	ym->windowed = 0;
+	ym->large_size = 0;
+
+	ret = txHeader( ym, filename );
+	if( ret != YM_SUCCESS ){
+		return ret;
+	}
+
+	ym->state = YM_STATE_POLLING;
+	return YM_SUCCESS;
+}
+
+/*
+ * @brief Something to write, wait for the line to take data
+ */
+int ymodem_wantWrite( ymodem_t *ym ){
+	ym_tx_t *tx = &ym->tx;
+
+	if( ym->state != YM_STATE_POLLING ){
+		return 0;
+	}
+	if( tx->out_idx != YM_TX_OUT_IDLE || tx->has_next || tx->eot || tx->resend != 0 ){
+		return 1;
+	}
+	return tx->phase == YM_TX_DATA && ( ym->streaming || ym->has_pending < txWindow( ym ) ) &&
+			( !tx->eof || tx->tail_size > 0 || ym->has_pending == 0 );
+}
+
+/*
+ * @brief Waiting for the receiver, run the timeout. Data from the line is
+ *        taken at any time
+ */
+int ymodem_wantRead( ymodem_t *ym ){
+	ym_tx_t *tx = &ym->tx;
+
+	if( ym->state != YM_STATE_POLLING ){
+		return 0;
+	}
+	switch( tx->phase ){
+	case YM_TX_HANDSHAKE:
+	case YM_TX_START:
+	case YM_TX_CLOSE:
+		return 1;
+	case YM_TX_EOT:
+		return !tx->eot && tx->out_idx == YM_TX_OUT_IDLE;
+	default:
+		return !ym->streaming && ym->has_pending > 0;
+	}
+}
+
+/*
+ * @brief The line takes data, write until it is full or there is nothing
+ *        more to send
+ */
+int ymodem_onWritable( ymodem_t *ym ){
+	ym_tx_t *tx = &ym->tx;
+	int count;
+	int left;
+	int ret;
+
+	YM_ASSERT( ym != NULL );
+
+	if( ym->state != YM_STATE_POLLING ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	while( 1 ){
+		ret = fillOut( ym );
+		if( ret != YM_SUCCESS ){
+			return txEnd( ym, ret );
+		}
+		if( tx->out_idx == YM_TX_OUT_IDLE ){
+			return YM_SUCCESS;
+		}
+
+		while( tx->out_idx < YM_TX_OUT_IDLE && tx->out_pos == tx->out_len[ tx->out_idx ] ){
+			tx->out_idx ++;
+			tx->out_pos = 0;
+		}
+		if( tx->out_idx == YM_TX_OUT_IDLE ){
+			putFlush( ym );
+			ret = txWritten( ym );
+			if( ret != YM_SUCCESS ){
+				return txEnd( ym, ret );
+			}
+			continue;
+		}
+
+		/* A short write goes on with the rest here, 0 is a full line and
+		 * waits for the next call */
+		left = tx->out_len[ tx->out_idx ] - tx->out_pos;
+		if( ym->config.putBlock != NULL ){
+			count = ym->config.putBlock( ym, tx->out_seg[ tx->out_idx ] + tx->out_pos, left );
+		}
+		else{
+			count = ym->config.putByte( ym, tx->out_seg[ tx->out_idx ][ tx->out_pos ] ) < 0 ? -1 : 1;
+		}
+		if( count < 0 || count > left ){
+			YM_PERROR( "Write error %d, %d bytes left\n", count, left );
+			return txEnd( ym, YM_ERROR_COMM );
+		}
+		if( count == 0 ){
+			/* Line full */
+			return YM_SUCCESS;
+		}
+		tx->out_pos += count;
+	}
+}
+
+/*
+ * @brief The line has data, take what is there
+ */
+int ymodem_onReadable( ymodem_t *ym ){
+	uint8_t buffer[16];
+	int count;
+	int idx;
+	int ret;
+
+	YM_ASSERT( ym != NULL );
+
+	if( ym->state != YM_STATE_POLLING ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	do{
+		count = getBytes( ym, buffer, sizeof(buffer), 0 );
+		for( idx=0; idx<count; ++idx ){
+			ret = txByte( ym, buffer[idx] );
+			if( ret != YM_SUCCESS ){
+				return txEnd( ym, ret );
+			}
+		}
+	}while( count == (int)sizeof(buffer) );
+
+	return YM_SUCCESS;
+}
+
+/*
+ * @brief Nothing came in for config.timeout while ymodem_wantRead
+ */
+int ymodem_onTimer( ymodem_t *ym ){
+	ym_tx_t *tx = &ym->tx;
+	int ret = YM_SUCCESS;
+
+	YM_ASSERT( ym != NULL );
+
+	if( ym->state != YM_STATE_POLLING ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	tx->answer = -1;
+	switch( tx->phase ){
+	case YM_TX_HANDSHAKE:
+	case YM_TX_CLOSE:
+		ret = txTry( ym );
+		break;
+	case YM_TX_START:
+		YM_PDEBUG( "Timeout\n" );
+		if( ++tx->retry >= ym->config.num_of_retry ){
+			ret = YM_ERROR_TIMEOUT;
+		}
+		break;
+	case YM_TX_EOT:
+		if( !tx->eot && tx->out_idx == YM_TX_OUT_IDLE ){
+			txEot( ym );
+		}
+		break;
+	default:
+		ret = txTimeout( ym );
+		break;
+	}
+
+	return ret == YM_SUCCESS ? ret : txEnd( ym, ret );
+}
+
+
+/* Receive parse phases */
+#define YM_RX_START    (0) /* SOH/STX, EOT or CA expected */
+#define YM_RX_HEADER   (1) /* packet number and its complement */
+#define YM_RX_DATA     (2)
+#define YM_RX_TRAILER  (3) /* CRC */
+#define YM_RX_CA       (4) /* one CA seen */
+
+/* Packet buffer for a packet number near the expected one, packets
+ * received ahead are kept there until it arrives. packet_idx doesn't wrap,
+ * the number on the wire does */
+static int rxBuff( ymodem_t *ym, uint8_t seq ){
+	return ( ym->packet_idx + (int8_t)(uint8_t)( seq - ym->packet_idx ) ) % (YM_WINDOW_MAX+1);
+}
+
+/* Character the receiver asks for packets with */
+static uint8_t startChar( ymodem_t *ym ){
+	if( ym->streaming ){
+		return YMODEM_G;
+	}
+	if( ym->windowed ){
+		return YMODEM_W;
+	}
+	return CRC16;
+}
+
+/* Answer a packet, followed by its number in windowed mode. YModem-g
+ * packets are not answered */
+static void reply( ymodem_t *ym, uint8_t bdata, uint8_t seq ){
+	uint8_t answer[2];
+
+	if( ym->streaming ){
+		return;
+	}
+
+	answer[0] = bdata;
+	answer[1] = seq;
+	putBlock( ym, answer, ym->windowed ? 2 : 1 );
+}
+
+/* The transfer ends inside a file, let the sink drop it */
+static void sinkAbort( ymodem_t *ym ){
+	if( ym->rx.in_file && ym->config.sink != NULL ){
+		ym->config.sink->ops->abort( ym->config.sink );
+	}
+	ym->rx.in_file = 0;
+}
+
+static int receiveAbort( ymodem_t *ym, int ret ){
+	YM_PERROR( "Receive aborted %d\n", ret );
+	sinkAbort( ym );
+	ym->config.putByte( ym, CA );
+	ym->config.putByte( ym, CA );
+	putFlush( ym );
+	ym->state = YM_STATE_READY;
+	return ret;
+}
+
+/* Bad or unexpected packet: NAK it, give up after too many in a row.
+ * YModem-g can't repeat packets, any error ends the transfer */
+static int receiveError( ymodem_t *ym, uint8_t seq ){
+	ym->rx.errors ++;
+	ym->rx.noise = 1;
+	if( ym->streaming || ym->rx.errors > ym->config.num_of_retry ){
+		return receiveAbort( ym, YM_ERROR_COMM );
+	}
+
+	reply( ym, NAK, seq );
+	return YM_SUCCESS;
+}
+
+/* Largest packet accepted for the offer, it has to fit ym->large. Packets
+ * received ahead use the same memory in windowed mode, so no large packets
+ * then */
+static int largeAccept( ymodem_t *ym, int offer ){
+	int size = largeOffer( ym );
+
+	if( ym->windowed ){
+		return 0;
+	}
+
+	while( size >= YM_PACKET_SIZE_4K &&
+			( size > offer || size > YM_LARGE_MAX ) ){
+		size /= 2;
+	}
+
+	return size >= YM_PACKET_SIZE_4K ? size : 0;
+}
+
+/*
+ * File header: name NUL size [mtime mode ...] NUL, and maybe the large
+ * packet offer 'L' size-in-KB after that.
+ * @ret Large packet size offered, 0: none
+ */
+static int parseHeader( ymodem_t *ym, const uint8_t *data, int size ){
+	ym_rx_t *rx = &ym->rx;
+	int offer = 0;
+	int idx;
+
+	for( idx=0; idx<size && data[idx]!=0; ++idx ){
+		if( rx->filename != NULL && idx < rx->filename_max-1 ){
+			rx->filename[idx] = data[idx];
+			rx->filename[idx+1] = 0;
+		}
+	}
+
+	rx->file_size = 0;
+	for( idx++; idx<size && data[idx]>='0' && data[idx]<='9'; ++idx ){
+		rx->file_size = rx->file_size*10 + data[idx]-'0';
+	}
+
+	while( idx<size && data[idx]!=0 ){
+		idx ++;
+	}
+	if( idx+1 < size && data[idx+1] == YMODEM_L ){
+		for( idx+=2; idx<size && data[idx]>='0' && data[idx]<='9'; ++idx ){
+			offer = offer*10 + data[idx]-'0';
+		}
+	}
+
+	YM_PDEBUG( "File %s, size %u\n", rx->filename != NULL ? rx->filename : "", rx->file_size );
+	return offer * YM_PACKET_SIZE_1K;
+}
+
+/* Answer a file header: ACK, the large packet size taken, and ask for data */
+static void answerHeader( ymodem_t *ym ){
+	reply( ym, ACK, 0 );
+	if( ym->large_size > 0 ){
+		ym->config.putByte( ym, YMODEM_L );
+		ym->config.putByte( ym, ym->large_size / YM_PACKET_SIZE_1K );
+	}
+	ym->config.putByte( ym, startChar( ym ) );
+}
+
+/* Pass packet data to the sink, the padding after the declared file size
+ * is dropped */
+static int deliver( ymodem_t *ym, const uint8_t *data, int size ){
+	ym_rx_t *rx = &ym->rx;
+	ym_sink_t *sink = ym->config.sink;
+	uint32_t offset = rx->file_pos;
+
+	if( rx->file_size > 0 && (uint32_t)size > rx->file_size - rx->file_pos ){
+		size = rx->file_size - rx->file_pos;
+	}
+	rx->file_pos += size;
+
+	if( size > 0 && sink != NULL && sink->ops->write( sink, offset, data, size ) < 0 ){
+		return receiveAbort( ym, YM_ERROR_WRITE );
+	}
+	return YM_SUCCESS;
+}
+
+/* Offset idx ( seq - packet_idx ) names a packet that was already received */
+static int rxBehind( ymodem_t *ym, int idx ){
+	if( ym->windowed ){
+		return idx >= 0x100 - YM_WINDOW_MAX;
+	}
+	return idx == 0xFF;
+}
+
+/* A whole packet is in, check and answer it */
+static int receivePacket( ymodem_t *ym ){
+	ym_rx_t *rx = &ym->rx;
+	uint8_t seq = rx->header[1];
+	int ret;
+	int idx;
+
+	if( rx->data_size > YM_PACKET_SIZE_1K ){
+		uint32_t crc = ( (uint32_t)rx->trailer[0]<<24 ) | ( (uint32_t)rx->trailer[1]<<16 ) |
+				( (uint32_t)rx->trailer[2]<<8 ) | rx->trailer[3];
+		if( Cal_CRC32( rx->data, rx->data_size ) != crc ){
+			YM_PERROR( "CRC error, packet %d\n", seq );
+			return receiveError( ym, seq );
+		}
+	}
+	else if( rx->crc != ( ( rx->trailer[0]<<8 ) | rx->trailer[1] ) ){
+		YM_PERROR( "CRC error, packet %d\n", seq );
+		return receiveError( ym, seq );
+	}
+
+	rx->begun = 1;
+
+	if( !rx->in_file ){
+		/* File header expected */
+		if( seq != 0 ){
+			YM_PERROR( "Expect file header, but packet %d received\n", seq );
+			return receiveError( ym, seq );
+		}
+		rx->errors = 0;
+
+		if( rx->data[0] == 0 ){
+			/* Empty header, end of session */
+			YM_PDEBUG( "Receive session done\n" );
+			reply( ym, ACK, 0 );
+			ym->state = YM_STATE_READY;
+			return YM_DONE;
+		}
+
+		ym->large_size = largeAccept( ym, parseHeader( ym, rx->data, rx->data_size ) );
+		if( ym->config.sink != NULL && ym->config.sink->ops->open( ym->config.sink,
+				rx->filename != NULL ? rx->filename : "", rx->file_size ) < 0 ){
+			return receiveAbort( ym, YM_ERROR_WRITE );
+		}
+		rx->in_file = 1;
+		rx->file_pos = 0;
+		for( idx=0; idx<YM_WINDOW_MAX+1; ++idx ){
+			rx->stored[idx] = 0;
+		}
+		ym->packet_idx = 1;
+		answerHeader( ym );
+		return YM_SUCCESS;
+	}
+
+	idx = (uint8_t)( seq - ym->packet_idx );
+	if( idx == 0 ){
+		rx->errors = 0;
+		ret = deliver( ym, rx->data, rx->data_size );
+		if( ret != YM_SUCCESS ){
+			return ret;
+		}
+		reply( ym, ACK, seq );
+		ym->packet_idx ++;
+
+		/* Packets received ahead may follow now */
+		while( rx->stored[ ym->packet_idx % (YM_WINDOW_MAX+1) ] > 0 ){
+			int buff = ym->packet_idx % (YM_WINDOW_MAX+1);
+
+			ret = deliver( ym, ym->packet[buff] + PACKET_DATA_INDEX, rx->stored[buff] );
+			if( ret != YM_SUCCESS ){
+				return ret;
+			}
+			rx->stored[buff] = 0;
+			ym->packet_idx ++;
+		}
+		return YM_SUCCESS;
+	}
+
+	if( rxBehind( ym, idx ) ){
+		/* Our answer got lost, the sender repeats the packet. In windowed
+		 * mode that may be any packet of its window */
+		YM_PDEBUG( "Repeated packet %d\n", seq );
+		if( ym->packet_idx == 1 && idx == 0xFF ){
+			answerHeader( ym );
+		}
+		else{
+			reply( ym, ACK, seq );
+		}
+		return YM_SUCCESS;
+	}
+
+	if( ym->windowed && idx < YM_WINDOW_MAX ){
+		/* Ahead of a lost packet, keep it */
+		YM_PDEBUG( "Packet %d received ahead\n", seq );
+		rx->stored[ rxBuff( ym, seq ) ] = rx->data_size;
+		reply( ym, ACK, seq );
+		return YM_SUCCESS;
+	}
+
+	YM_PERROR( "Expect packet %d, but %d received\n", (uint8_t)ym->packet_idx, seq );
+	return receiveError( ym, seq );
+}
+
+/*
+ * Out of sync, bytes of a broken packet may look like anything. Only a
+ * packet start with a number that fits is taken then, EOT and CA count
+ * again once a packet or a quiet line was seen.
+ */
+static int plausibleStart( ymodem_t *ym ){
+	int idx = (uint8_t)( ym->rx.header[1] - ym->packet_idx );
+
+	if( !ym->rx.in_file ){
+		return idx == 0;
+	}
+	return idx == 0 || rxBehind( ym, idx ) || ( ym->windowed && idx < YM_WINDOW_MAX );
+}
+
+/* Packet header is in, pick where the payload goes */
+static void receiveStart( ymodem_t *ym ){
+	ym_rx_t *rx = &ym->rx;
+	uint8_t seq = rx->header[1];
+	int idx = (uint8_t)( seq - ym->packet_idx );
+
+	rx->data_size = rx->header[0] == SOH ? YM_PACKET_SIZE_128 :
+			rx->header[0] == STX ? YM_PACKET_SIZE_1K : ym->large_size;
+	rx->data_idx = 0;
+	rx->trailer_idx = 0;
+	rx->crc = 0;
+
+	if( rx->data_size > YM_PACKET_SIZE_1K ){
+		rx->data = ym->large + PACKET_DATA_INDEX;
+	}
+	else if( !rx->in_file ){
+		rx->data = ym->packet[0] + PACKET_DATA_INDEX;
+	}
+	else if( idx != 0 && !( ym->windowed && idx < YM_WINDOW_MAX ) ){
+		/* Not to be kept, don't overwrite one that is */
+		rx->data = ym->packet[ rxBuff( ym, ym->packet_idx-1 ) ] + PACKET_DATA_INDEX;
+	}
+	else{
+		rx->data = ym->packet[ rxBuff( ym, seq ) ] + PACKET_DATA_INDEX;
+	}
+}
+
+/* EOT: the file is complete, ask for the next header. A repeated EOT
+ * is answered again */
+static int receiveEot( ymodem_t *ym ){
+	YM_PDEBUG( "EOT received\n" );
+	if( ym->rx.in_file && ym->config.sink != NULL &&
+			ym->config.sink->ops->finish( ym->config.sink, ym->rx.file_pos ) < 0 ){
+		return receiveAbort( ym, YM_ERROR_WRITE );
+	}
+	ym->rx.in_file = 0;
+	ym->rx.errors = 0;
+	ym->packet_idx = 0;
+	ym->config.putByte( ym, ACK );
+	ym->config.putByte( ym, startChar( ym ) );
+	return YM_SUCCESS;
+}
+
+/*
+ * @brief Start a receive session, asks the sender for the file header
+ * @param filename Receives the name of each file, may be NULL
+ * @param maxlens  Size of filename
+ */
+int ymodem_startReceive( ymodem_t *ym, char *filename, int maxlens ){
+	YM_PDEBUG( "YModem start receive\n" );
+	YM_ASSERT( ym != NULL );
+
+	if( ym->state != YM_STATE_READY ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	arraySet( (uint8_t*)&ym->rx, 0, sizeof(ym->rx) );
+	ym->rx.filename = filename;
+	ym->rx.filename_max = maxlens;
+	if( filename != NULL && maxlens > 0 ){
+		filename[0] = 0;
+	}
+
+	ym->streaming = (ym->config.options & YM_OPT_STREAMING) != 0;
+	ym->windowed = !ym->streaming && (ym->config.options & YM_OPT_WINDOW) != 0;
+	ym->large_size = 0;
+	ym->packet_idx = 0;
+	ym->state = YM_STATE_RECEIVING;
+
+	ym->config.putByte( ym, startChar( ym ) );
+	putFlush( ym );
+	return YM_SUCCESS;
+}
+
+static int isStart( ymodem_t *ym, uint8_t bdata ){
+	return bdata == SOH || bdata == STX || ( bdata == STX_LARGE && ym->large_size > 0 );
+}
+
+/* Run the receive phases over a chunk of received bytes */
+static int receiveChunk( ymodem_t *ym, const uint8_t *buffer, int size ){
+	ym_rx_t *rx = &ym->rx;
+	int idx = 0;
+	int ret;
+
+	YM_ASSERT( ym != NULL );
+
+	if( ym->state != YM_STATE_RECEIVING ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	while( idx < size ){
+		switch( rx->phase ){
+		case YM_RX_START:
+			if( rx->noise ){
+				/* EOT and CA don't count now, skip to the next packet start */
+				idx += Scan_Packet_Start( buffer + idx, size - idx, ym->large_size > 0 );
+				if( idx == size ){
+					break;
+				}
+			}
+			rx->header[0] = buffer[idx++];
+			if( isStart( ym, rx->header[0] ) ){
+				rx->header_idx = 1;
+				rx->phase = YM_RX_HEADER;
+			}
+			else if( rx->header[0] == EOT && !rx->noise ){
+				ret = receiveEot( ym );
+				if( ret != YM_SUCCESS ){
+					return ret;
+				}
+			}
+			else if( rx->header[0] == CA && !rx->noise ){
+				rx->phase = YM_RX_CA;
+			}
+			else{
+				/* Line noise */
+				rx->noise = 1;
+			}
+			break;
+
+		case YM_RX_HEADER:
+			rx->header[ rx->header_idx++ ] = buffer[idx++];
+			if( rx->header_idx < (int)PACKET_HEADER_SIZE ){
+				break;
+			}
+			if( (uint8_t)( rx->header[1] ^ rx->header[2] ) != 0xFF ||
+					( rx->noise && !plausibleStart( ym ) ) ){
+				/* Not a packet start after all, the real one may be
+				 * among the bytes taken for its number */
+				rx->noise = 1;
+				rx->phase = YM_RX_START;
+				if( isStart( ym, rx->header[1] ) ){
+					rx->header[0] = rx->header[1];
+					rx->header[1] = rx->header[2];
+					rx->header_idx = 2;
+					rx->phase = YM_RX_HEADER;
+				}
+				else if( isStart( ym, rx->header[2] ) ){
+					rx->header[0] = rx->header[2];
+					rx->header_idx = 1;
+					rx->phase = YM_RX_HEADER;
+				}
+				break;
+			}
+			rx->noise = 0;
+			receiveStart( ym );
+			rx->phase = YM_RX_DATA;
+			break;
+
+		case YM_RX_DATA:{
+			int part = rx->data_size - rx->data_idx;
+
+			if( part > size - idx ){
+				part = size - idx;
+			}
+			if( rx->data_size > YM_PACKET_SIZE_1K ){
+				arrayCpy( rx->data + rx->data_idx, buffer + idx, part );
+			}
+			else{
+				rx->crc = Cal_CRC16_Copy( rx->crc, rx->data + rx->data_idx, buffer + idx, part );
+			}
+			rx->data_idx += part;
+			idx += part;
+			if( rx->data_idx == rx->data_size ){
+				rx->phase = YM_RX_TRAILER;
+			}
+			break;
+		}
+
+		case YM_RX_TRAILER:
+			rx->trailer[ rx->trailer_idx++ ] = buffer[idx++];
+			if( rx->trailer_idx < ( rx->data_size > YM_PACKET_SIZE_1K ? (int)PACKET_CRC32_SIZE : (int)PACKET_TRAILER_SIZE ) ){
+				break;
+			}
+			rx->phase = YM_RX_START;
+			ret = receivePacket( ym );
+			if( ret != YM_SUCCESS ){
+				return ret;
+			}
+			break;
+
+		case YM_RX_CA:
+			rx->phase = YM_RX_START;
+			if( buffer[idx] == CA ){
+				/* Remote abort */
+				YM_PDEBUG( "Remote abort\n" );
+				sinkAbort( ym );
+				ym->state = YM_STATE_READY;
+				return YM_ERROR_ABORT;
+			}
+			break;
+		}
+	}
+
+	return YM_SUCCESS;
+}
+
+/*
+ * @brief Feed received bytes to the receive engine, any amount at a time
+ * @ret   YM_SUCCESS: go on, YM_DONE: session finished, <0: error
+ */
+int ymodem_Receive( ymodem_t *ym, const uint8_t *buffer, int size ){
+	int ret = receiveChunk( ym, buffer, size );
+
+	/* Answers to all packets of the chunk go out together */
+	putFlush( ym );
+	return ret;
+}
+
+/*
+ * @brief Nothing received for config.timeout: drop a partial packet and
+ *        ask again, give up after num_of_retry in a row
+ */
+int ymodem_receiveTimeout( ymodem_t *ym ){
+	ym_rx_t *rx = &ym->rx;
+
+	YM_ASSERT( ym != NULL );
+
+	if( ym->state != YM_STATE_RECEIVING ){
+		YM_PERROR( "State error\n" );
+		return YM_ERROR_STATE;
+	}
+
+	rx->phase = YM_RX_START;
+	rx->noise = 0;
+	rx->errors ++;
+	if( rx->begun && rx->errors > ym->config.num_of_retry ){
+		return receiveAbort( ym, YM_ERROR_TIMEOUT );
+	}
+	if( !rx->begun && ( ym->streaming || ym->windowed ) ){
+		/* The sender doesn't know 'G'/'W', fall back to 'C' for good. Right
+		 * away: a legacy sender counts every 'G'/'W' against its retries.
+		 * Going back to 'G'/'W' later could meet a header sent for the 'C' */
+		YM_PDEBUG( "No answer to %c, asking with C\n", startChar( ym ) );
+		ym->streaming = 0;
+		ym->windowed = 0;
+	}
+
+	if( !rx->in_file ){
+		ym->config.putByte( ym, startChar( ym ) );
+	}
+	else if( !ym->windowed && !ym->streaming ){
+		ym->config.putByte( ym, NAK );
+	}
+	putFlush( ym );
+
+	return YM_SUCCESS;
+}
+
+/* Bytes still missing from the packet being parsed, 1 between packets */
+static int receiveWant( ymodem_t *ym ){
+	ym_rx_t *rx = &ym->rx;
+	int trailer;
+	int size;
+
+	switch( rx->phase ){
+	case YM_RX_HEADER:
+		size = rx->header[0] == SOH ? YM_PACKET_SIZE_128 :
+				rx->header[0] == STX ? YM_PACKET_SIZE_1K : ym->large_size;
+		trailer = size > YM_PACKET_SIZE_1K ? PACKET_CRC32_SIZE : PACKET_TRAILER_SIZE;
+		return PACKET_HEADER_SIZE - rx->header_idx + size + trailer;
+	case YM_RX_DATA:
+		trailer = rx->data_size > YM_PACKET_SIZE_1K ? PACKET_CRC32_SIZE : PACKET_TRAILER_SIZE;
+		return rx->data_size - rx->data_idx + trailer;
+	case YM_RX_TRAILER:
+		trailer = rx->data_size > YM_PACKET_SIZE_1K ? PACKET_CRC32_SIZE : PACKET_TRAILER_SIZE;
+		return trailer - rx->trailer_idx;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * @brief Blocking receive after ymodem_startReceive, reads with getBlock
+ *        (or getByte). Once a packet start is seen the rest of the packet
+ *        is asked for in one read.
+ * @ret   YM_DONE: session finished, <0: error
+ */
+int ymodem_runReceive( ymodem_t *ym ){
+	uint8_t buffer[ PACKET_HEADER_SIZE + YM_PACKET_SIZE_1K + PACKET_TRAILER_SIZE ];
+	int ret = YM_SUCCESS;
+	int count;
+	int want;
+
+	YM_ASSERT( ym != NULL );
+
+	while( ret == YM_SUCCESS ){
+		want = receiveWant( ym );
+		if( want > (int)sizeof(buffer) ){
+			want = sizeof(buffer);
+		}
+
+		count = getBytes( ym, buffer, want, ym->config.timeout );
+		if( count > 0 ){
+			ret = ymodem_Receive( ym, buffer, count );
+		}
+		if( ret == YM_SUCCESS && count < want ){
+			ret = ymodem_receiveTimeout( ym );
+		}
+	}
+
+	return ret;
+}
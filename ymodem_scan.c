@@ -0,0 +1,145 @@
+#include "ymodem.h"
+
+/*
+ * Resynchronization scanner for the receiver.
+ *
+ * Out of sync, the receiver throws bytes away until something looks like a
+ * packet start: SOH, STX (or STX_LARGE once large blocks are agreed) followed
+ * by a packet number and its complement. Bursts of noise are skipped here in
+ * bulk instead of byte by byte through the parser.
+ *
+ * With YM_SCAN_SIMD the scan runs 16 (SSE2) or 32 (AVX2) positions per step,
+ * the kernel is picked at runtime on the first call. The scalar loop is the
+ * reference and handles the tail of each chunk.
+ */
+#ifndef YM_SCAN_SIMD
+#define YM_SCAN_SIMD 1
+#endif
+
+#if YM_SCAN_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define YM_SCAN_SIMD_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+static int scan_portable(const uint8_t* p_data, int size, int large)
+{
+	uint8_t last = large ? STX_LARGE : STX;
+	int idx;
+
+	for(idx = 0; idx < size; idx++)
+	{
+		if(p_data[idx] < SOH || p_data[idx] > last)
+			continue;
+		/* Cut at the end of the chunk, let the parser decide */
+		if(idx + 2 >= size || (uint8_t)(p_data[idx + 1] ^ p_data[idx + 2]) == 0xFF)
+			return idx;
+	}
+
+	return size;
+}
+
+#if YM_SCAN_SIMD_X86
+/* Start byte at idx and complementary bytes at idx+1, idx+2, 16 at a time */
+__attribute__((target("sse2")))
+static int scan_sse2(const uint8_t* p_data, int size, int large)
+{
+	const __m128i soh = _mm_set1_epi8(SOH);
+	const __m128i last = _mm_set1_epi8(large ? STX_LARGE : STX);
+	const __m128i ones = _mm_set1_epi8((char)0xFF);
+	int idx;
+
+	for(idx = 0; idx + 16 + 2 <= size; idx += 16)
+	{
+		__m128i b0 = _mm_loadu_si128((const __m128i*)(p_data + idx));
+		__m128i b1 = _mm_loadu_si128((const __m128i*)(p_data + idx + 1));
+		__m128i b2 = _mm_loadu_si128((const __m128i*)(p_data + idx + 2));
+		/* SOH <= b0 <= last, unsigned */
+		__m128i start = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(b0, soh), b0),
+		                              _mm_cmpeq_epi8(_mm_min_epu8(b0, last), b0));
+		__m128i hit = _mm_and_si128(start, _mm_cmpeq_epi8(_mm_xor_si128(b1, b2), ones));
+		int mask = _mm_movemask_epi8(hit);
+
+		if(mask)
+			return idx + __builtin_ctz(mask);
+	}
+
+	return idx + scan_portable(p_data + idx, size - idx, large);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const uint8_t* p_data, int size, int large)
+{
+	const __m256i soh = _mm256_set1_epi8(SOH);
+	const __m256i last = _mm256_set1_epi8(large ? STX_LARGE : STX);
+	const __m256i ones = _mm256_set1_epi8((char)0xFF);
+	int idx;
+
+	for(idx = 0; idx + 32 + 2 <= size; idx += 32)
+	{
+		__m256i b0 = _mm256_loadu_si256((const __m256i*)(p_data + idx));
+		__m256i b1 = _mm256_loadu_si256((const __m256i*)(p_data + idx + 1));
+		__m256i b2 = _mm256_loadu_si256((const __m256i*)(p_data + idx + 2));
+		__m256i start = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(b0, soh), b0),
+		                                 _mm256_cmpeq_epi8(_mm256_min_epu8(b0, last), b0));
+		__m256i hit = _mm256_and_si256(start, _mm256_cmpeq_epi8(_mm256_xor_si256(b1, b2), ones));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(hit);
+
+		if(mask)
+			return idx + __builtin_ctz(mask);
+	}
+
+	return idx + scan_sse2(p_data + idx, size - idx, large);
+}
+
+static int scan_select(const uint8_t* p_data, int size, int large);
+
+/* Resolved on the first call. Threads may get there together and all
+ * store the same value, the pointer is accessed atomically so that is no
+ * data race. Relaxed is enough, the kernels use no shared state */
+static int (*scan_resolved)(const uint8_t* p_data, int size, int large) = scan_select;
+
+static int scan_select(const uint8_t* p_data, int size, int large)
+{
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	int (*kernel)(const uint8_t*, int, int) = scan_portable;
+
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2))
+		kernel = scan_sse2;
+	/* AVX2 also needs the OS to save the ymm state */
+	if(__get_cpuid_max(0, NULL) >= 7 && (ecx & bit_OSXSAVE) && (ecx & bit_AVX))
+	{
+		unsigned int xcr0_lo, xcr0_hi;
+
+		__asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		(void)xcr0_hi;
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if((xcr0_lo & 6) == 6 && (ebx & bit_AVX2))
+			kernel = scan_avx2;
+	}
+
+	__atomic_store_n(&scan_resolved, kernel, __ATOMIC_RELAXED);
+	return kernel(p_data, size, large);
+}
+
+static int scan_kernel(const uint8_t* p_data, int size, int large)
+{
+	return __atomic_load_n(&scan_resolved, __ATOMIC_RELAXED)(p_data, size, large);
+}
+#else
+#define scan_kernel scan_portable
+#endif
+
+/**
+ * @brief  Find the next plausible packet start in a received chunk
+ * @param  p_data
+ * @param  size
+ * @param  large  STX_LARGE counts as a start too
+ * @retval Offset of the first start byte followed by a packet number and its
+ *         complement, or of a start byte too close to the end to tell.
+ *         size if there is none.
+ */
+int Scan_Packet_Start(const uint8_t* p_data, int size, int large)
+{
+	return scan_kernel(p_data, size, large);
+}
@@ -0,0 +1,519 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* fallocate */
+#endif
+#include <stdio.h>
+#include <string.h>
+#include "ymodem.h"
+
+#if YM_SINK_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/* The file sink syncs with fsync where there is one */
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define YM_SINK_FSYNC 1
+#else
+#define YM_SINK_FSYNC 0
+#endif
+
+/*
+ * Receive sinks shipped with the library: memory, null, stdio file and,
+ * on POSIX systems, memory mapped file. The async sink runs one of them on
+ * a writer thread.
+ * Each embeds ym_sink_t first, the ops cast it back.
+ */
+
+/* Where a file sink writes: its path, or the name from the header without
+ * its directories so the sender can't pick them. NULL: no usable name */
+static const char *sinkPath( const char *path, const char *name ){
+	const char *base;
+
+	if( path != NULL ){
+		return path;
+	}
+	for( base=name; *name!=0; ++name ){
+		if( *name == '/' || *name == '\\' ){
+			base = name + 1;
+		}
+	}
+	if( *base == 0 || strcmp( base, "." ) == 0 || strcmp( base, ".." ) == 0 ){
+		return NULL;
+	}
+	return base;
+}
+
+/* Memory sink ---------------------------------------------------------------*/
+static int memOpen( ym_sink_t *sink, const char *name, uint32_t size ){
+	ym_mem_sink_t *ms = (ym_mem_sink_t*)sink;
+
+	(void)name;
+	if( size > ms->capacity ){
+		return -1;
+	}
+	ms->size = 0;
+	ms->complete = 0;
+	return 0;
+}
+
+static int memWrite( ym_sink_t *sink, uint32_t offset, const uint8_t *data, int size ){
+	ym_mem_sink_t *ms = (ym_mem_sink_t*)sink;
+
+	if( offset > ms->capacity || (uint32_t)size > ms->capacity - offset ){
+		return -1;
+	}
+	memcpy( ms->buffer + offset, data, size );
+	if( offset + size > ms->size ){
+		ms->size = offset + size;
+	}
+	return 0;
+}
+
+static int memFinish( ym_sink_t *sink, uint32_t size ){
+	ym_mem_sink_t *ms = (ym_mem_sink_t*)sink;
+
+	ms->size = size;
+	ms->complete = 1;
+	return 0;
+}
+
+static void memAbort( ym_sink_t *sink ){
+	ym_mem_sink_t *ms = (ym_mem_sink_t*)sink;
+
+	ms->size = 0;
+	ms->complete = 0;
+}
+
+static const ym_sink_ops_t mem_ops = { memOpen, memWrite, memFinish, memAbort };
+
+/*
+ * @brief Sink keeping the last file received in buffer, a file larger than
+ *        capacity cancels the transfer
+ */
+ym_sink_t *ymodem_memSink( ym_mem_sink_t *ms, uint8_t *buffer, uint32_t capacity ){
+	ms->sink.ops = &mem_ops;
+	ms->buffer = buffer;
+	ms->capacity = capacity;
+	ms->size = 0;
+	ms->complete = 0;
+	return &ms->sink;
+}
+
+/* Null sink -----------------------------------------------------------------*/
+static int nullOpen( ym_sink_t *sink, const char *name, uint32_t size ){
+	(void)name;
+	(void)size;
+	((ym_null_sink_t*)sink)->files ++;
+	return 0;
+}
+
+static int nullWrite( ym_sink_t *sink, uint32_t offset, const uint8_t *data, int size ){
+	(void)offset;
+	(void)data;
+	((ym_null_sink_t*)sink)->bytes += size;
+	return 0;
+}
+
+static int nullFinish( ym_sink_t *sink, uint32_t size ){
+	(void)sink;
+	(void)size;
+	return 0;
+}
+
+static void nullAbort( ym_sink_t *sink ){
+	(void)sink;
+}
+
+static const ym_sink_ops_t null_ops = { nullOpen, nullWrite, nullFinish, nullAbort };
+
+/*
+ * @brief Sink dropping the data, for measuring the protocol on its own
+ */
+ym_sink_t *ymodem_nullSink( ym_null_sink_t *ns ){
+	ns->sink.ops = &null_ops;
+	ns->files = 0;
+	ns->bytes = 0;
+	return &ns->sink;
+}
+
+/* File sink -----------------------------------------------------------------*/
+static int fileOpen( ym_sink_t *sink, const char *name, uint32_t size ){
+	ym_file_sink_t *fs = (ym_file_sink_t*)sink;
+	const char *path = sinkPath( fs->path, name );
+
+	(void)size;
+	if( path == NULL ){
+		return -1;
+	}
+
+	fs->fp = fopen( path, "wb" );
+	fs->pos = 0;
+	return fs->fp != NULL ? 0 : -1;
+}
+
+static int fileWrite( ym_sink_t *sink, uint32_t offset, const uint8_t *data, int size ){
+	ym_file_sink_t *fs = (ym_file_sink_t*)sink;
+
+	if( offset != fs->pos && fseek( fs->fp, offset, SEEK_SET ) != 0 ){
+		return -1;
+	}
+	if( fwrite( data, 1, size, fs->fp ) != (size_t)size ){
+		return -1;
+	}
+	fs->pos = offset + size;
+	return 0;
+}
+
+static int fileFinish( ym_sink_t *sink, uint32_t size ){
+	ym_file_sink_t *fs = (ym_file_sink_t*)sink;
+	int ret;
+
+	(void)size;
+	/* On disk before the EOT is answered, as the mmap sink does */
+	ret = fflush( fs->fp );
+#if YM_SINK_FSYNC
+	if( ret == 0 ){
+		ret = fsync( fileno( fs->fp ) );
+	}
+#endif
+	if( fclose( fs->fp ) != 0 ){
+		ret = -1;
+	}
+	fs->fp = NULL;
+	return ret == 0 ? 0 : -1;
+}
+
+static void fileAbort( ym_sink_t *sink ){
+	ym_file_sink_t *fs = (ym_file_sink_t*)sink;
+
+	/* The partial file is left for a look */
+	fclose( fs->fp );
+	fs->fp = NULL;
+}
+
+static const ym_sink_ops_t file_ops = { fileOpen, fileWrite, fileFinish, fileAbort };
+
+/*
+ * @brief Sink writing each file with stdio, buffered as stdio does
+ * @param path Every file goes there, NULL: the name from the header in the
+ *             current directory
+ */
+ym_sink_t *ymodem_fileSink( ym_file_sink_t *fs, const char *path ){
+	fs->sink.ops = &file_ops;
+	fs->path = path;
+	fs->fp = NULL;
+	fs->pos = 0;
+	return &fs->sink;
+}
+
+#if YM_SINK_MMAP
+/* Memory mapped file sink ---------------------------------------------------*/
+/* Reserve the blocks up front, so running out of space fails here and not
+ * as SIGBUS on a store into the map. fallocate itself: posix_fallocate
+ * would write a byte per block on a file system without it */
+static int mmapReserve( int fd, uint32_t size ){
+#if defined(__linux__)
+	if( fallocate( fd, 0, 0, size ) == 0 ){
+		return 0;
+	}
+	if( errno != EOPNOTSUPP && errno != ENOSYS ){
+		return -1;
+	}
+	/* Not supported here, map a sparse file */
+	return ftruncate( fd, size ) == 0 ? 0 : -1;
+#else
+	(void)fd;
+	(void)size;
+	/* Can't reserve, write through pwrite then */
+	return 1;
+#endif
+}
+
+static int mmapOpen( ym_sink_t *sink, const char *name, uint32_t size ){
+	ym_mmap_sink_t *ms = (ym_mmap_sink_t*)sink;
+	const char *path = sinkPath( ms->path, name );
+	void *map;
+	int ret;
+
+	if( path == NULL ){
+		return -1;
+	}
+
+	ms->fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0666 );
+	ms->map = NULL;
+	ms->map_size = 0;
+	if( ms->fd < 0 ){
+		return -1;
+	}
+	if( size == 0 ){
+		/* Size unknown, pwrite as packets come */
+		return 0;
+	}
+
+	ret = mmapReserve( ms->fd, size );
+	if( ret < 0 ){
+		close( ms->fd );
+		ms->fd = -1;
+		return -1;
+	}
+	if( ret > 0 ){
+		return 0;
+	}
+
+	map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ms->fd, 0 );
+	if( map == MAP_FAILED ){
+		return 0;
+	}
+	madvise( map, size, MADV_SEQUENTIAL );
+	ms->map = (uint8_t*)map;
+	ms->map_size = size;
+	return 0;
+}
+
+static int mmapWrite( ym_sink_t *sink, uint32_t offset, const uint8_t *data, int size ){
+	ym_mmap_sink_t *ms = (ym_mmap_sink_t*)sink;
+	ssize_t count;
+
+	if( ms->map != NULL && offset <= ms->map_size && (uint32_t)size <= ms->map_size - offset ){
+		memcpy( ms->map + offset, data, size );
+		return 0;
+	}
+
+	while( size > 0 ){
+		count = pwrite( ms->fd, data, size, offset );
+		if( count < 0 && errno == EINTR ){
+			continue;
+		}
+		if( count <= 0 ){
+			return -1;
+		}
+		data += count;
+		offset += count;
+		size -= count;
+	}
+	return 0;
+}
+
+static void mmapUnmap( ym_mmap_sink_t *ms ){
+	if( ms->map != NULL ){
+		munmap( ms->map, ms->map_size );
+		ms->map = NULL;
+		ms->map_size = 0;
+	}
+}
+
+static int mmapFinish( ym_sink_t *sink, uint32_t size ){
+	ym_mmap_sink_t *ms = (ym_mmap_sink_t*)sink;
+	int ret;
+
+	/* Down to the bytes received, drops what was reserved but not sent */
+	mmapUnmap( ms );
+	ret = ftruncate( ms->fd, size );
+	if( ret == 0 ){
+		ret = fsync( ms->fd );
+	}
+	if( close( ms->fd ) != 0 ){
+		ret = -1;
+	}
+	ms->fd = -1;
+	return ret == 0 ? 0 : -1;
+}
+
+static void mmapAbort( ym_sink_t *sink ){
+	ym_mmap_sink_t *ms = (ym_mmap_sink_t*)sink;
+
+	/* The partial file is left for a look */
+	mmapUnmap( ms );
+	close( ms->fd );
+	ms->fd = -1;
+}
+
+static const ym_sink_ops_t mmap_ops = { mmapOpen, mmapWrite, mmapFinish, mmapAbort };
+
+/*
+ * @brief Sink writing each file through a shared mapping. The file is
+ *        preallocated with the size from the header and the data is copied
+ *        to its offset, at EOT it is cut to the bytes received. A file
+ *        system without fallocate gets a sparse file. Without a size in the
+ *        header, or off Linux, it writes with pwrite.
+ * @param path Every file goes there, NULL: the name from the header in the
+ *             current directory
+ */
+ym_sink_t *ymodem_mmapSink( ym_mmap_sink_t *ms, const char *path ){
+	ms->sink.ops = &mmap_ops;
+	ms->path = path;
+	ms->fd = -1;
+	ms->map = NULL;
+	ms->map_size = 0;
+	return &ms->sink;
+}
+#endif
+
+#if YM_SINK_ASYNC
+/* Async sink ----------------------------------------------------------------*/
+#define YM_ASYNC_OPEN    (0)
+#define YM_ASYNC_WRITE   (1)
+#define YM_ASYNC_FINISH  (2)
+#define YM_ASYNC_ABORT   (3)
+#define YM_ASYNC_STOP    (4)
+
+static void *asyncWriter( void *arg ){
+	ym_async_sink_t *as = (ym_async_sink_t*)arg;
+	ym_sink_t *target = as->target;
+	ym_async_slot_t *slot;
+	int cmd;
+	int ret;
+
+	for( ;; ){
+		while( sem_wait( &as->filled ) != 0 );
+		slot = &as->slot[ as->head % YM_ASYNC_SLOTS ];
+		cmd = slot->cmd;
+
+		switch( cmd ){
+		case YM_ASYNC_WRITE:
+			/* After a failure the rest of the file is dropped */
+			if( !__atomic_load_n( &as->error, __ATOMIC_RELAXED ) &&
+					target->ops->write( target, slot->offset, slot->data, slot->size ) < 0 ){
+				__atomic_store_n( &as->error, 1, __ATOMIC_RELAXED );
+			}
+			break;
+		case YM_ASYNC_OPEN:
+			as->result = target->ops->open( target, (const char*)slot->data, slot->size );
+			break;
+		case YM_ASYNC_FINISH:
+			ret = target->ops->finish( target, slot->size );
+			as->result = __atomic_load_n( &as->error, __ATOMIC_RELAXED ) ? -1 : ret;
+			break;
+		case YM_ASYNC_ABORT:
+			target->ops->abort( target );
+			break;
+		}
+
+		/* The slot may be filled again from here on */
+		as->head ++;
+		sem_post( &as->space );
+		if( cmd != YM_ASYNC_WRITE ){
+			/* The engine waits for the result */
+			sem_post( &as->drained );
+			if( cmd == YM_ASYNC_STOP ){
+				return NULL;
+			}
+		}
+	}
+}
+
+/* Next free slot, waits while the writer is a whole ring behind */
+static ym_async_slot_t *asyncSlot( ym_async_sink_t *as, int cmd ){
+	ym_async_slot_t *slot;
+
+	while( sem_wait( &as->space ) != 0 );
+	slot = &as->slot[ as->tail % YM_ASYNC_SLOTS ];
+	slot->cmd = cmd;
+	return slot;
+}
+
+static void asyncPush( ym_async_sink_t *as ){
+	as->tail ++;
+	sem_post( &as->filled );
+}
+
+/* Push a command and wait until the writer is done with it and all
+ * before it */
+static int asyncWait( ym_async_sink_t *as ){
+	asyncPush( as );
+	while( sem_wait( &as->drained ) != 0 );
+	return as->result;
+}
+
+static int asyncOpen( ym_sink_t *sink, const char *name, uint32_t size ){
+	ym_async_sink_t *as = (ym_async_sink_t*)sink;
+	ym_async_slot_t *slot = asyncSlot( as, YM_ASYNC_OPEN );
+	int len = strlen( name );
+
+	if( len > YM_ASYNC_SLOT_SIZE-1 ){
+		len = YM_ASYNC_SLOT_SIZE-1;
+	}
+	memcpy( slot->data, name, len );
+	slot->data[len] = 0;
+	slot->size = size;
+	as->error = 0;
+	return asyncWait( as );
+}
+
+static int asyncWrite( ym_sink_t *sink, uint32_t offset, const uint8_t *data, int size ){
+	ym_async_sink_t *as = (ym_async_sink_t*)sink;
+	ym_async_slot_t *slot;
+	int part;
+
+	while( size > 0 ){
+		if( __atomic_load_n( &as->error, __ATOMIC_RELAXED ) ){
+			return -1;
+		}
+		part = size < YM_ASYNC_SLOT_SIZE ? size : YM_ASYNC_SLOT_SIZE;
+		slot = asyncSlot( as, YM_ASYNC_WRITE );
+		memcpy( slot->data, data, part );
+		slot->offset = offset;
+		slot->size = part;
+		asyncPush( as );
+		data += part;
+		offset += part;
+		size -= part;
+	}
+	return __atomic_load_n( &as->error, __ATOMIC_RELAXED ) ? -1 : 0;
+}
+
+static int asyncFinish( ym_sink_t *sink, uint32_t size ){
+	ym_async_sink_t *as = (ym_async_sink_t*)sink;
+	ym_async_slot_t *slot = asyncSlot( as, YM_ASYNC_FINISH );
+
+	slot->size = size;
+	return asyncWait( as );
+}
+
+static void asyncAbort( ym_sink_t *sink ){
+	ym_async_sink_t *as = (ym_async_sink_t*)sink;
+
+	asyncSlot( as, YM_ASYNC_ABORT );
+	asyncWait( as );
+}
+
+static const ym_sink_ops_t async_ops = { asyncOpen, asyncWrite, asyncFinish, asyncAbort };
+
+/*
+ * @brief Run target on a writer thread, stop it with ymodem_asyncSinkStop
+ * @ret   The sink, NULL: the thread can't be started
+ */
+ym_sink_t *ymodem_asyncSink( ym_async_sink_t *as, ym_sink_t *target ){
+	as->sink.ops = &async_ops;
+	as->target = target;
+	as->head = 0;
+	as->tail = 0;
+	as->error = 0;
+	as->result = 0;
+	sem_init( &as->filled, 0, 0 );
+	sem_init( &as->space, 0, YM_ASYNC_SLOTS );
+	sem_init( &as->drained, 0, 0 );
+	if( pthread_create( &as->thread, NULL, asyncWriter, as ) != 0 ){
+		sem_destroy( &as->filled );
+		sem_destroy( &as->space );
+		sem_destroy( &as->drained );
+		return NULL;
+	}
+	return &as->sink;
+}
+
+/*
+ * @brief Let the writer finish what is queued and end the thread
+ */
+void ymodem_asyncSinkStop( ym_async_sink_t *as ){
+	asyncSlot( as, YM_ASYNC_STOP );
+	asyncWait( as );
+	pthread_join( as->thread, NULL );
+	sem_destroy( &as->filled );
+	sem_destroy( &as->space );
+	sem_destroy( &as->drained );
+}
+#endif